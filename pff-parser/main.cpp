@@ -9,12 +9,37 @@
 
 static void usage(void)
 {
-    fprintf(stderr, "Usage:  pff-parser -r -i in -o out -\n\n");
+    fprintf(stderr, "Usage:  pff-parser -r -s -n -m -j jobs -f fields -i in -o out - [in...]\n\n");
     fprintf(stderr, "text extractor for ost/pst documents\n\n");
     fprintf(stderr, " -%c path: %s\n", 'i' , "document to parse");
     fprintf(stderr, " -%c path: %s\n", 'o' , "text output (default=stdout)");
     fprintf(stderr, " %c: %s\n", '-' , "use stdin for input");
     fprintf(stderr, " -%c: %s\n", 'r' , "raw text output (default=json)");
+    fprintf(stderr, " -%c: %s\n", 's' , "stream json output while parsing");
+    fprintf(stderr, " -%c: %s\n", 'n' , "ndjson output (one message per line)");
+    fprintf(stderr, " -%c: %s\n", 'm' , "map the input file into memory");
+    fprintf(stderr, " -%c number: %s\n", 'j' , "worker threads (default=1, number of cores in batch mode)");
+    fprintf(stderr, " -%c list: %s\n", 'f' , "--fields to extract (subject,sender,recipients,text,html,time)");
+    fprintf(stderr, " --%s list: %s\n", "body-preference" , "bodies text comes from, best first (default=plain,html,rtf)");
+    fprintf(stderr, " --%s text: %s\n", "field-delimiter" , "raw text field separator (\\t \\n \\r \\0 \\\\ \\xHH)");
+    fprintf(stderr, " --%s text: %s\n", "record-delimiter" , "raw text message separator");
+    fprintf(stderr, " --%s: %s\n", "senders" , "write each sender/recipient once and refer to it by index");
+    fprintf(stderr, " --%s mode: %s\n", "dedup" , "skip or ref messages already seen (by content hash)");
+    fprintf(stderr, " --%s path: %s\n", "dedup-file" , "load and save the content hashes seen");
+    fprintf(stderr, " --%s path: %s\n", "attachments" , "write attachments to a directory, with name, size and sha256 in the json");
+    fprintf(stderr, " --%s path: %s\n", "attachment-store" , "write each distinct attachment once, as ab/cd/<sha256>");
+    fprintf(stderr, " --%s depth: %s\n", "embedded" , "read attached messages, and theirs, down to depth");
+    fprintf(stderr, " --%s glob: %s\n", "folder" , "only folders matching, !glob to skip (Inbox/**, /Top/*, repeatable)");
+    fprintf(stderr, " --%s list: %s\n", "ids" , "only the messages with these identifiers (1,2,3 or @path)");
+    fprintf(stderr, " --%s path: %s\n", "manifest" , "only write messages new or changed since the last run, and the removed ones");
+    fprintf(stderr, " --%s path: %s\n", "checkpoint" , "save the position reached every 1000 messages (-n or -r with -o)");
+    fprintf(stderr, " --%s: %s\n", "resume" , "continue from the checkpoint, appending to the output");
+    fprintf(stderr, " --%s size: %s\n", "max-memory" , "bound decoded messages held in memory (K, M, G)");
+    fprintf(stderr, " --%s path: %s\n", "inputs" , "batch: file with one document path per line");
+    fprintf(stderr, " --%s path: %s\n", "dir" , "batch: every pst/ost/pab under a directory");
+    fprintf(stderr, " --%s path: %s\n", "output-dir" , "batch: one output per document (default=one ndjson stream)");
+    fprintf(stderr, " --%s: %s\n", "stats" , "print timings and counters to stderr");
+    fprintf(stderr, " --%s path: %s\n", "stats-file" , "write timings and counters to a json file");
 
     exit(1);
 }
@@ -69,286 +94,3925 @@ int getopt(int argc, OPTARG_T *argv, OPTARG_T opts) {
     }
     return(c);
 }
-#define ARGS (OPTARG_T)L"i:o:-rh"
+#define ARGS (OPTARG_T)L"i:o:-rsnmj:f:hST:F:R:I:D:O:M:CU:V:K:ZX:L:P:A:B:E:Y:"
 #else
-#define ARGS "i:o:-rh"
+#define ARGS "i:o:-rsnmj:f:hST:F:R:I:D:O:M:CU:V:K:ZX:L:P:A:B:E:Y:"
 #endif
 
-struct Account {
+/*
+ * long options are rewritten to their short form
+ * so that the same getopt loop works on every platform
+ */
+struct LongOption {
+    const char *name;
+    char ch;
+};
+
+static const LongOption long_options[] = {
+    {"fields"          , 'f'},
+    {"help"            , 'h'},
+    {"stats"           , 'S'},
+    {"stats-file"      , 'T'},
+    {"field-delimiter" , 'F'},
+    {"record-delimiter", 'R'},
+    {"inputs"          , 'I'},
+    {"dir"             , 'D'},
+    {"output-dir"      , 'O'},
+    {"max-memory"      , 'M'},
+    {"senders"         , 'C'},
+    {"dedup"           , 'U'},
+    {"dedup-file"      , 'V'},
+    {"checkpoint"      , 'K'},
+    {"resume"          , 'Z'},
+    {"manifest"        , 'X'},
+    {"ids"             , 'L'},
+    {"folder"          , 'P'},
+    {"attachments"     , 'A'},
+    {"attachment-store", 'B'},
+    {"embedded"        , 'E'},
+    {"body-preference" , 'Y'},
+};
+
+typedef std::basic_string<OPTCHAR_T> arg_string;
+
+static bool match_long_option(const OPTCHAR_T *arg, const char *name, const OPTCHAR_T **value) {
+    
+    for (; *name; ++arg, ++name) {
+        if(*arg != (OPTCHAR_T)*name) return false;
+    }
+    if(*arg == '=') {
+        *value = arg + 1;
+        return true;
+    }
+    *value = NULL;
+    return *arg == 0;
+}
+
+static std::vector<OPTARG_T> expand_long_options(int argc, OPTARG_T argv[], std::list<arg_string>& storage) {
+    
+    std::vector<OPTARG_T> args;
+    for (int i = 0; i < argc; ++i) {
+        OPTARG_T arg = argv[i];
+        if((i) && (arg[0] == '-') && (arg[1] == '-') && (arg[2] != 0)) {
+            for (const auto &option : long_options) {
+                const OPTCHAR_T *value = NULL;
+                if(match_long_option(arg + 2, option.name, &value)) {
+                    storage.push_back(arg_string(1, '-') + (OPTCHAR_T)option.ch);
+                    args.push_back(&storage.back()[0]);
+                    if(value) {
+                        storage.push_back(value);
+                        args.push_back(&storage.back()[0]);
+                    }
+                    arg = NULL;
+                    break;
+                }
+            }
+        }
+        if(arg) args.push_back(arg);
+    }
+    args.push_back(NULL);
+    return args;
+}
+
+enum {
+    FIELD_SUBJECT    = 1 << 0,
+    FIELD_SENDER     = 1 << 1,
+    FIELD_RECIPIENTS = 1 << 2,
+    FIELD_TEXT       = 1 << 3,
+    FIELD_HTML       = 1 << 4,
+    FIELD_TIME       = 1 << 5,
+};
+
+#define DEFAULT_FIELDS (FIELD_SUBJECT | FIELD_SENDER | FIELD_TEXT)
+
+static unsigned int parse_fields(const OPTCHAR_T *arg) {
+    
+    static const struct {
+        const char *name;
+        unsigned int field;
+    } names[] = {
+        {"subject"   , FIELD_SUBJECT},
+        {"sender"    , FIELD_SENDER},
+        {"recipient" , FIELD_RECIPIENTS},
+        {"recipients", FIELD_RECIPIENTS},
+        {"text"      , FIELD_TEXT},
+        {"html"      , FIELD_HTML},
+        {"time"      , FIELD_TIME},
+    };
+    
+    unsigned int fields = 0;
+    std::string name;
+    for (const OPTCHAR_T *c = arg; ; ++c) {
+        if((*c == ',') || (*c == 0)) {
+            unsigned int field = 0;
+            for (const auto &n : names) {
+                if(name == n.name) field = n.field;
+            }
+            if(!field) {
+                std::cerr << "Unknown field: " << name << std::endl;
+                usage();
+            }
+            fields |= field;
+            name.clear();
+            if(*c == 0) break;
+        }else{
+            name += (char)*c;
+        }
+    }
+    return fields;
+}
+
+/* --body-preference: the bodies text may come from, best first */
+static void parse_body_preference(const OPTCHAR_T *arg, std::vector<uint32_t>& body) {
+    
+    static const struct {
+        const char *name;
+        uint32_t entry_type;
+    } names[] = {
+        {"plain", LIBPFF_ENTRY_TYPE_MESSAGE_BODY_PLAIN_TEXT},
+        {"html" , LIBPFF_ENTRY_TYPE_MESSAGE_BODY_HTML},
+        {"rtf"  , LIBPFF_ENTRY_TYPE_MESSAGE_BODY_COMPRESSED_RTF},
+    };
+    
+    body.clear();
     std::string name;
-    std::string address;
+    for (const OPTCHAR_T *c = arg; ; ++c) {
+        if((*c == ',') || (*c == 0)) {
+            uint32_t entry_type = 0;
+            for (const auto &n : names) {
+                if(name == n.name) entry_type = n.entry_type;
+            }
+            if(!entry_type) {
+                std::cerr << "Unknown body: " << name << std::endl;
+                usage();
+            }
+            if(std::find(body.begin(), body.end(), entry_type) == body.end()) body.push_back(entry_type);
+            name.clear();
+            if(*c == 0) break;
+        }else{
+            name += (char)*c;
+        }
+    }
+}
+
+/* delimiters are given with c escapes so that tabs and nul can be passed */
+static std::string parse_delimiter(const OPTCHAR_T *arg) {
+    
+    std::string delimiter;
+    for (const OPTCHAR_T *c = arg; *c; ++c) {
+        if((*c != '\\') || (c[1] == 0)) {
+            delimiter += (char)*c;
+            continue;
+        }
+        switch (*++c) {
+            case 't':
+                delimiter += '\t';
+                break;
+            case 'n':
+                delimiter += '\n';
+                break;
+            case 'r':
+                delimiter += '\r';
+                break;
+            case '0':
+                delimiter += '\0';
+                break;
+            case 'x':
+            {
+                int value = 0;
+                int digits = 0;
+                for (; (digits < 2) && isxdigit((int)c[1]); ++digits) {
+                    ++c;
+                    value = value * 16 + (isdigit((int)*c) ? *c - '0' : (tolower((int)*c) - 'a' + 10));
+                }
+                delimiter += (char)value;
+            }
+                break;
+            default:
+                delimiter += (char)*c;
+                break;
+        }
+    }
+    return delimiter;
+}
+
+static size_t parse_size(const OPTCHAR_T *arg) {
+    
+    size_t size = 0;
+    const OPTCHAR_T *c = arg;
+    for (; (*c >= '0') && (*c <= '9'); ++c) {
+        size = size * 10 + (size_t)(*c - '0');
+    }
+    switch (*c) {
+        case 'g':
+        case 'G':
+            size *= 1024;
+            [[fallthrough]];
+        case 'm':
+        case 'M':
+            size *= 1024;
+            [[fallthrough]];
+        case 'k':
+        case 'K':
+            size *= 1024;
+            break;
+        default:
+            break;
+    }
+    return size;
+}
+
+/* identifiers are separated by anything but digits; @path reads them from a file */
+static void parse_ids(const OPTCHAR_T *arg, std::vector<uint32_t>& ids) {
+    
+    std::string text;
+    if(*arg == '@') {
+        std::ifstream in{std::filesystem::path(arg + 1), std::ios::binary};
+        if(!in) {
+            std::cerr << "Failed to open identifier list!" << std::endl;
+            exit(1);
+        }
+        std::stringstream buf;
+        buf << in.rdbuf();
+        text = buf.str();
+    }else{
+        for (const OPTCHAR_T *c = arg; *c; ++c) {
+            text += ((*c >= '0') && (*c <= '9')) ? (char)*c : ' ';
+        }
+    }
+    uint64_t id = 0;
+    bool digits = false;
+    for (size_t i = 0; i <= text.length(); ++i) {
+        if((i < text.length()) && (text[i] >= '0') && (text[i] <= '9')) {
+            id = id * 10 + (uint64_t)(text[i] - '0');
+            digits = true;
+            if(id > UINT32_MAX) {
+                std::cerr << "Invalid identifier!" << std::endl;
+                exit(1);
+            }
+        }else if(digits) {
+            ids.push_back((uint32_t)id);
+            id = 0;
+            digits = false;
+        }
+    }
+}
+
+/* the extraction plan: which properties are decoded for each message */
+static unsigned int entry_type_field(uint32_t entry_type) {
+    
+    switch (entry_type) {
+        case LIBPFF_ENTRY_TYPE_MESSAGE_SUBJECT:
+            return FIELD_SUBJECT;
+        case LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_NAME:
+        case LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_EMAIL_ADDRESS:
+            return FIELD_SENDER;
+        case LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_NAME:
+        case LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_EMAIL_ADDRESS:
+            return FIELD_RECIPIENTS;
+        case LIBPFF_ENTRY_TYPE_MESSAGE_BODY_PLAIN_TEXT:
+        case LIBPFF_ENTRY_TYPE_MESSAGE_BODY_COMPRESSED_RTF:
+        case LIBPFF_ENTRY_TYPE_MESSAGE_BODY_CODEPAGE:
+            return FIELD_TEXT;
+        case LIBPFF_ENTRY_TYPE_MESSAGE_BODY_HTML:
+            return FIELD_HTML;
+        case LIBPFF_ENTRY_TYPE_MESSAGE_CLIENT_SUBMIT_TIME:
+        case LIBPFF_ENTRY_TYPE_MESSAGE_DELIVERY_TIME:
+            return FIELD_TIME;
+        default:
+            return 0;
+    }
+}
+
+class StringPool;
+class Dedup;
+class Manifest;
+class FolderFilter;
+class AttachmentStore;
+struct Resume;
+
+struct Context {
+    unsigned int fields;
+    int jobs;
+    const OPTARG_T filename;
+    const uint8_t *memory;
+    size_t memory_size;
+    size_t max_memory;
+    StringPool *pool;
+    bool senders;
+    Dedup *dedup;
+    const OPTARG_T checkpoint;
+    const Resume *resume;
+    Manifest *manifest;
+    const std::vector<uint32_t> *ids;
+    const FolderFilter *filter;
+    const std::filesystem::path *attachments;
+    AttachmentStore *store;
+    int embedded;
+    const std::vector<uint32_t> *body;
+};
+
+/*
+ * --stats: phase timers and counters, shared by all workers;
+ * timers are only read when stats are enabled
+ */
+#define NUM_FIELDS 6
+
+struct Stats {
+    bool enabled;
+    std::atomic<uint64_t> open_ns;
+    std::atomic<uint64_t> traversal_ns;
+    std::atomic<uint64_t> decode_ns[NUM_FIELDS];
+    std::atomic<uint64_t> serialization_ns;
+    std::atomic<uint64_t> write_ns;
+    std::atomic<uint64_t> messages;
+    std::atomic<uint64_t> folders;
+    std::atomic<uint64_t> bytes_decoded;
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> errors;
+};
+
+static Stats stats;
+
+class Timer {
+    std::atomic<uint64_t> *_total;
+    std::chrono::steady_clock::time_point _start;
+public:
+    Timer(std::atomic<uint64_t>& total) : _total(stats.enabled ? &total : NULL) {
+        if(_total) _start = std::chrono::steady_clock::now();
+    }
+    ~Timer() {
+        stop();
+    }
+    void stop() {
+        if(_total) {
+            *_total += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+            _total = NULL;
+        }
+    }
+};
+
+static int field_index(unsigned int field) {
+    
+    int i = 0;
+    while ((field > 1) && (i < NUM_FIELDS - 1)) {
+        field >>= 1;
+        i++;
+    }
+    return i;
+}
+
+static size_t get_peak_rss(void) {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return (size_t)counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+static void report_stats(const OPTARG_T path, uint64_t total_ns) {
+    
+    static const char *field_names[NUM_FIELDS] = {"subject", "sender", "recipients", "text", "html", "time"};
+    
+    Json::Value phasesNode(Json::objectValue);
+    phasesNode["open"] = stats.open_ns / 1e9;
+    phasesNode["traversal"] = stats.traversal_ns / 1e9;
+    uint64_t decode_ns = 0;
+    Json::Value decodeNode(Json::objectValue);
+    for (int i = 0; i < NUM_FIELDS; ++i) {
+        decodeNode[field_names[i]] = stats.decode_ns[i] / 1e9;
+        decode_ns += stats.decode_ns[i];
+    }
+    phasesNode["decode"] = decode_ns / 1e9;
+    phasesNode["serialization"] = stats.serialization_ns / 1e9;
+    phasesNode["write"] = stats.write_ns / 1e9;
+    phasesNode["total"] = total_ns / 1e9;
+    
+    Json::Value countsNode(Json::objectValue);
+    countsNode["messages"] = (Json::UInt64)stats.messages;
+    countsNode["folders"] = (Json::UInt64)stats.folders;
+    countsNode["bytes_decoded"] = (Json::UInt64)stats.bytes_decoded;
+    countsNode["bytes_written"] = (Json::UInt64)stats.bytes_written;
+    countsNode["errors"] = (Json::UInt64)stats.errors;
+    
+    Json::Value statsNode(Json::objectValue);
+    statsNode["phases"] = std::move(phasesNode);
+    statsNode["decode"] = std::move(decodeNode);
+    statsNode["counts"] = std::move(countsNode);
+    statsNode["peak_rss"] = (Json::UInt64)get_peak_rss();
+    
+    Json::StreamWriterBuilder writer;
+    writer["precision"] = 6;
+    std::string text = Json::writeString(writer, statsNode);
+    if(path) {
+        FILE *f = _fopen(path, _wb);
+        if(f) {
+            fwrite(text.c_str(), 1, text.length(), f);
+            fclose(f);
+        }else{
+            std::cerr << "Failed to open stats file!" << std::endl;
+        }
+    }else{
+        std::cerr << text << std::endl;
+    }
+}
+
+/*
+ * monotonic arena for message strings: bytes are appended to large blocks
+ * and released together, so a decoded message costs no allocation of its own;
+ * clear() keeps one block for reuse
+ */
+#define ARENA_BLOCK (BUFLEN * 8)
+
+class Arena {
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Block> _blocks;
+    size_t _used;
+    size_t _bytes;
+public:
+    Arena() : _used(0), _bytes(0) {}
+    Arena(Arena&& other) : _blocks(std::move(other._blocks)), _used(other._used), _bytes(other._bytes) {
+        other._blocks.clear();
+        other._used = 0;
+        other._bytes = 0;
+    }
+    Arena& operator=(Arena&& other) {
+        if(this != &other) {
+            _blocks = std::move(other._blocks);
+            _used = other._used;
+            _bytes = other._bytes;
+            other._blocks.clear();
+            other._used = 0;
+            other._bytes = 0;
+        }
+        return *this;
+    }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    
+    char *allocate(size_t size) {
+        _bytes += size;
+        if(!_blocks.size()) {
+            _blocks.push_back({std::unique_ptr<char[]>(new char[ARENA_BLOCK]), ARENA_BLOCK});
+            _used = 0;
+        }
+        if(size > ARENA_BLOCK / 4) {
+            /* large values get their own block behind the current one */
+            _blocks.insert(_blocks.end() - 1, {std::unique_ptr<char[]>(new char[size]), size});
+            return (_blocks.end() - 2)->data.get();
+        }
+        if(_used + size > _blocks.back().size) {
+            _blocks.push_back({std::unique_ptr<char[]>(new char[ARENA_BLOCK]), ARENA_BLOCK});
+            _used = 0;
+        }
+        char *p = _blocks.back().data.get() + _used;
+        _used += size;
+        return p;
+    }
+    std::string_view copy(const char *data, size_t size) {
+        if(!size) return std::string_view();
+        char *p = allocate(size);
+        memcpy(p, data, size);
+        return std::string_view(p, size);
+    }
+    /* takes over the blocks of another arena; views into them stay valid */
+    void absorb(Arena&& other) {
+        if(!other._blocks.size()) return;
+        if(!_blocks.size()) {
+            *this = std::move(other);
+            return;
+        }
+        _blocks.insert(_blocks.end() - 1,
+                       std::make_move_iterator(other._blocks.begin()),
+                       std::make_move_iterator(other._blocks.end()));
+        _bytes += other._bytes;
+        other._blocks.clear();
+        other._used = 0;
+        other._bytes = 0;
+    }
+    void clear() {
+        if(_blocks.size() > 1) {
+            _blocks.erase(_blocks.begin() + 1, _blocks.end());
+        }
+        if((_blocks.size()) && (_blocks.front().size != ARENA_BLOCK)) {
+            _blocks.clear();
+        }
+        _used = 0;
+        _bytes = 0;
+    }
+    size_t bytes() const { return _bytes; }
+};
+
+/*
+ * interned correspondent strings: a mailbox has few distinct senders,
+ * so messages hold ids into one pool shared by all workers; id 0 is ""
+ */
+class StringPool {
+    mutable std::mutex _mutex;
+    Arena _arena;
+    std::unordered_map<std::string_view, uint32_t> _ids;
+    std::vector<std::string_view> _strings;
+public:
+    StringPool() : _strings(1) {}
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    uint32_t intern(std::string_view value) {
+        if(!value.length()) return 0;
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _ids.find(value);
+        if(it != _ids.end()) return it->second;
+        std::string_view copy = _arena.copy(value.data(), value.length());
+        uint32_t id = (uint32_t)_strings.size();
+        _strings.push_back(copy);
+        _ids.emplace(copy, id);
+        return id;
+    }
+    std::string_view get(uint32_t id) const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _strings[id];
+    }
+};
+
+/* names and addresses are ids into the StringPool */
+struct Account {
+    uint32_t name = 0;
+    uint32_t address = 0;
+};
+
+/* --senders: each distinct account is written once and referred to by index */
+class AccountTable {
+    std::unordered_map<uint64_t, uint32_t> _index;
+    std::vector<Account> _accounts;
+public:
+    uint32_t index(const Account& account, bool *added = NULL) {
+        uint64_t key = ((uint64_t)account.name << 32) | account.address;
+        auto it = _index.find(key);
+        if(added) *added = (it == _index.end());
+        if(it != _index.end()) return it->second;
+        uint32_t i = (uint32_t)_accounts.size();
+        _accounts.push_back(account);
+        _index.emplace(key, i);
+        return i;
+    }
+    const std::vector<Account>& accounts() const {
+        return _accounts;
+    }
+};
+
+/* the strings of a message point into the arena it was read with */
+
+/* an attachment written with --attachments; the data itself is never held in memory */
+struct Attachment {
+    std::string_view name;
+    std::string_view file;
+    uint64_t size = 0;
+    uint8_t sha256[32];
 };
 
 struct Message {
-    std::string subject;
-    std::string text;
-    std::string html;
-    std::string rtf;
+    std::string_view subject;
+    std::string_view text;
+    std::string_view html;
+    std::string_view rtf;
+    uint64_t time = 0;
     Account sender;
     Account recipient;
+    uint64_t hash = 0;
+    bool duplicate = false;
+    /* position in its folder, for checkpoints */
+    int index = 0;
+    /* with --manifest or --ids */
+    uint32_t id = 0;
+    uint64_t modified = 0;
+    /* --manifest: content_hash */
+    uint64_t content = 0;
+    enum Status { NEW, CHANGED, UNCHANGED } status = NEW;
+    std::vector<Attachment> attachments;
+    /* --embedded: attached messages, read into the same arena */
+    std::vector<Message> embedded;
+};
+
+/* what a decoded message costs while it waits for the writer */
+static size_t message_size(const Message& message) {
+    size_t size = sizeof(Message)
+    + message.subject.length()
+    + message.text.length()
+    + message.html.length()
+    + message.rtf.length();
+    for (const auto &attachment : message.attachments) {
+        size += sizeof(Attachment) + attachment.name.length() + attachment.file.length();
+    }
+    for (const auto &embedded : message.embedded) {
+        size += message_size(embedded);
+    }
+    return size;
+}
+
+/*
+ * --dedup: messages are identified by a hash of normalized sender address,
+ * subject, delivery time and body; the first one seen is written and later
+ * ones are skipped or written as a reference to its hash
+ */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t value) {
+    acc ^= xxh_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* XXH64, little-endian hosts */
+static uint64_t xxh64(const void *input, size_t len, uint64_t seed = 0) {
+    
+    const uint8_t *p = (const uint8_t *)input;
+    const uint8_t *end = p + len;
+    uint64_t h;
+    if(len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }else{
+        h = seed + XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if(p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h ^= (uint64_t)v * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* runs of whitespace become one space, leading and trailing whitespace is dropped */
+static void append_normalized(std::string& buf, std::string_view value, bool lower) {
+    
+    bool space = false;
+    size_t start = buf.length();
+    for (char c : value) {
+        if((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) {
+            space = true;
+            continue;
+        }
+        if((space) && (buf.length() > start)) buf += ' ';
+        space = false;
+        buf += lower ? (char)tolower((unsigned char)c) : c;
+    }
+    buf += '\0';
+}
+
+static uint64_t message_hash(const Message& message, const StringPool& pool) {
+    
+    static thread_local std::string buf;
+    buf.clear();
+    append_normalized(buf, pool.get(message.sender.address), true);
+    append_normalized(buf, message.subject, false);
+    buf.append((const char *)&message.time, sizeof(message.time));
+    append_normalized(buf, message.text, false);
+    return xxh64(buf.data(), buf.length());
+}
+
+static void append_value(std::string& buf, std::string_view value) {
+    
+    uint64_t length = value.length();
+    buf.append((const char *)&length, sizeof(length));
+    buf.append(value.data(), value.length());
+}
+
+static void append_content(std::string& buf, const Message& message, unsigned int fields, const StringPool& pool) {
+    
+    if(fields & FIELD_SUBJECT) append_value(buf, message.subject);
+    if(fields & FIELD_TEXT) append_value(buf, message.text);
+    if(fields & FIELD_HTML) append_value(buf, message.html);
+    if(fields & FIELD_TIME) buf.append((const char *)&message.time, sizeof(message.time));
+    if(fields & FIELD_SENDER) {
+        append_value(buf, pool.get(message.sender.name));
+        append_value(buf, pool.get(message.sender.address));
+    }
+    if(fields & FIELD_RECIPIENTS) {
+        append_value(buf, pool.get(message.recipient.name));
+        append_value(buf, pool.get(message.recipient.address));
+    }
+    uint64_t count = message.attachments.size();
+    buf.append((const char *)&count, sizeof(count));
+    for (const auto &attachment : message.attachments) {
+        append_value(buf, attachment.name);
+        buf.append((const char *)&attachment.size, sizeof(attachment.size));
+        buf.append((const char *)attachment.sha256, sizeof(attachment.sha256));
+    }
+    count = message.embedded.size();
+    buf.append((const char *)&count, sizeof(count));
+    for (const auto &child : message.embedded) {
+        append_content(buf, child, fields, pool);
+    }
+}
+
+/*
+ * --manifest: the selected fields exactly as they are written, with the
+ * attachment digests and the embedded messages, so any change to the
+ * output is a change; message_hash is only what makes a duplicate
+ */
+static uint64_t content_hash(const Message& message, unsigned int fields, const StringPool& pool) {
+    
+    std::string buf;
+    append_content(buf, message, fields, pool);
+    return xxh64(buf.data(), buf.length());
+}
+
+static std::string hash_to_string(uint64_t hash) {
+    
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+    return buf;
+}
+
+/* SHA-256 (FIPS 180-4), fed in chunks as attachments are streamed */
+class Sha256 {
+    uint32_t _state[8];
+    uint8_t _block[64];
+    size_t _used;
+    uint64_t _length;
+    static inline uint32_t rotr(uint32_t x, int r) {
+        return (x >> r) | (x << (32 - r));
+    }
+    void transform(const uint8_t *block) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+        uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        _state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+        _state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+    }
+public:
+    Sha256() : _state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}, _used(0), _length(0) {}
+    void update(const uint8_t *data, size_t len) {
+        _length += len;
+        if(_used) {
+            size_t n = std::min(len, sizeof(_block) - _used);
+            memcpy(_block + _used, data, n);
+            _used += n;
+            data += n;
+            len -= n;
+            if(_used < sizeof(_block)) return;
+            transform(_block);
+            _used = 0;
+        }
+        for (; len >= sizeof(_block); data += sizeof(_block), len -= sizeof(_block)) {
+            transform(data);
+        }
+        memcpy(_block, data, len);
+        _used = len;
+    }
+    void final(uint8_t digest[32]) {
+        uint64_t bits = _length * 8;
+        uint8_t pad[72] = {0x80};
+        size_t n = (_used < 56 ? 56 : 120) - _used;
+        for (int i = 0; i < 8; ++i) {
+            pad[n + i] = (uint8_t)(bits >> (56 - i * 8));
+        }
+        update(pad, n + 8);
+        for (int i = 0; i < 8; ++i) {
+            digest[i * 4]     = (uint8_t)(_state[i] >> 24);
+            digest[i * 4 + 1] = (uint8_t)(_state[i] >> 16);
+            digest[i * 4 + 2] = (uint8_t)(_state[i] >> 8);
+            digest[i * 4 + 3] = (uint8_t)(_state[i]);
+        }
+    }
+};
+
+static std::string digest_to_string(const uint8_t digest[32]) {
+
+    static const char hex[] = "0123456789abcdef";
+    std::string text(64, '0');
+    for (int i = 0; i < 32; ++i) {
+        text[i * 2]     = hex[digest[i] >> 4];
+        text[i * 2 + 1] = hex[digest[i] & 15];
+    }
+    return text;
+}
+
+class Dedup {
+    std::mutex _mutex;
+    std::unordered_set<uint64_t> _seen;
+    std::vector<uint64_t> _added;
+public:
+    enum Mode { SKIP, REF } mode;
+    Dedup(Mode m) : mode(m) {}
+    /* false if the hash was seen before */
+    bool insert(uint64_t hash) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_seen.insert(hash).second) return false;
+        _added.push_back(hash);
+        return true;
+    }
+    /* the file is a plain array of 64 bit little-endian hashes */
+    void load(const OPTARG_T path) {
+        FILE *f = _fopen(path, _rb);
+        if(!f) return;
+        uint64_t hash;
+        while (fread(&hash, sizeof(hash), 1, f) == 1) {
+            _seen.insert(hash);
+        }
+        fclose(f);
+    }
+    void save(const OPTARG_T path) {
+        if(!_added.size()) return;
+        FILE *f = _fopen(path, _ab);
+        if(!f) {
+            std::cerr << "Failed to open dedup file!" << std::endl;
+            return;
+        }
+        fwrite(_added.data(), sizeof(uint64_t), _added.size(), f);
+        fclose(f);
+        _added.clear();
+    }
+};
+
+#define DEDUP_FIELDS (FIELD_SENDER | FIELD_SUBJECT | FIELD_TIME | FIELD_TEXT)
+
+/*
+ * --manifest: the identifier, modification time and content hash of every
+ * message of the last run; a message with the same modification time is not
+ * decoded again, one with a new time but the same hash is still unchanged;
+ * the previous entries are only read during the traversal, the new ones are
+ * added in output order
+ */
+class Manifest {
+    struct Entry {
+        uint64_t modified;
+        uint64_t hash;
+    };
+    std::unordered_map<uint32_t, Entry> _previous;
+    std::unordered_map<uint32_t, Entry> _current;
+    std::vector<uint32_t> _order;
+public:
+    /* the hash is that of the previous run when the message is unchanged */
+    bool unchanged(uint32_t id, uint64_t modified, uint64_t& hash) const {
+        auto it = _previous.find(id);
+        if((it == _previous.end()) || (it->second.modified != modified)) return false;
+        hash = it->second.hash;
+        return true;
+    }
+    Message::Status status(uint32_t id, uint64_t hash) const {
+        auto it = _previous.find(id);
+        if(it == _previous.end()) return Message::NEW;
+        return it->second.hash == hash ? Message::UNCHANGED : Message::CHANGED;
+    }
+    void add(uint32_t id, uint64_t modified, uint64_t hash) {
+        if(_current.insert({id, {modified, hash}}).second) _order.push_back(id);
+    }
+    /* messages of the last run that were not seen in this one */
+    std::vector<uint32_t> removed() const {
+        std::vector<uint32_t> ids;
+        for (const auto &entry : _previous) {
+            if(!_current.count(entry.first)) ids.push_back(entry.first);
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+    /* the file is a plain array of {id, modified, hash}, 64 bit little-endian each */
+    void load(const OPTARG_T path) {
+        FILE *f = _fopen(path, _rb);
+        if(!f) return;
+        uint64_t record[3];
+        while (fread(record, sizeof(record), 1, f) == 1) {
+            _previous[(uint32_t)record[0]] = {record[1], record[2]};
+        }
+        fclose(f);
+    }
+    /* rewritten aside and renamed, so a failed run leaves the last manifest */
+    void save(const OPTARG_T path) {
+        std::filesystem::path temp(path);
+        temp += ".tmp";
+        FILE *f = _fopen(temp.c_str(), _wb);
+        if(!f) {
+            std::cerr << "Failed to open manifest file!" << std::endl;
+            return;
+        }
+        bool ok = true;
+        for (uint32_t id : _order) {
+            const Entry& entry = _current[id];
+            uint64_t record[3] = {id, entry.modified, entry.hash};
+            ok = ok && (fwrite(record, sizeof(record), 1, f) == 1);
+        }
+        ok = (fclose(f) == 0) && ok;
+        std::error_code ec;
+        if(ok) std::filesystem::rename(temp, std::filesystem::path(path), ec);
+        if((!ok) || (ec)) std::cerr << "Failed to write manifest file!" << std::endl;
+    }
+};
+
+struct Folder {
+    std::string name;
+    std::vector<Folder> folders;
+    std::vector<Message> messages;
+    Arena arena;
 };
 
-struct Folder {
-    std::string name;
-    std::vector<Folder> folders;
-    std::vector<Message> messages;
-};
+struct Document {
+    std::string type;
+    std::vector<Folder> folders;
+    std::vector<uint32_t> removed;
+};
+
+#if defined(_WIN32)
+static int create_temp_file_path(std::wstring& path) {
+    std::vector<wchar_t>buf(1024);
+    if (GetTempPathW((DWORD)buf.size(), buf.data()) == 0) return -1;
+    if (GetTempFileNameW(buf.data(), L"pff", 0, buf.data()) == 0) return -1;
+    path = std::wstring(buf.data());
+    return 0;
+}
+#else
+static int create_temp_file_path(std::string& path) {
+    const char *tmpdir = getenv("TMPDIR");
+    if (!tmpdir) tmpdir = "/tmp";
+    std::vector<char>buf(1024);
+    snprintf(buf.data(), buf.size(), "%s/pffXXXXXX", tmpdir);
+    path = std::string(buf.data());
+    int fd = mkstemp((char *)path.c_str());
+    if (fd == -1) return -1;
+    close(fd);
+    return 0;
+}
+#endif
+
+static std::string path_to_utf8(const std::filesystem::path& path) {
+#if defined(_WIN32)
+    const std::wstring& wide = path.native();
+    int len = WideCharToMultiByte(CP_UTF8, 0, wide.c_str(), (int)wide.length(), NULL, 0, NULL, NULL);
+    std::string utf8(len, 0);
+    if(len) WideCharToMultiByte(CP_UTF8, 0, wide.c_str(), (int)wide.length(), &utf8[0], len, NULL, NULL);
+    return utf8;
+#else
+    return path.native();
+#endif
+}
+
+static std::filesystem::path utf8_to_path(const std::string& utf8) {
+#if defined(_WIN32)
+    int len = MultiByteToWideChar(CP_UTF8, 0, utf8.c_str(), (int)utf8.length(), NULL, 0);
+    std::wstring wide(len, 0);
+    if(len) MultiByteToWideChar(CP_UTF8, 0, utf8.c_str(), (int)utf8.length(), &wide[0], len);
+    return std::filesystem::path(wide);
+#else
+    return std::filesystem::path(utf8);
+#endif
+}
+
+/*
+ * stdin: a redirected regular file is opened where it is; anything else
+ * is read in chunks without asking for its size, into memory when libpff
+ * can read from an io handle, or else spooled into a temp file
+ */
+static bool get_stdin_path(arg_string& path) {
+#if defined(_WIN32)
+    HANDLE h = GetStdHandle(STD_INPUT_HANDLE);
+    if(GetFileType(h) != FILE_TYPE_DISK) return false;
+    std::vector<wchar_t>buf(1024);
+    DWORD len = GetFinalPathNameByHandleW(h, buf.data(), (DWORD)buf.size(), FILE_NAME_NORMALIZED);
+    if((len == 0) || (len >= buf.size())) return false;
+    path = buf.data();
+    return true;
+#else
+    struct stat st;
+    if((fstat(fileno(stdin), &st) != 0) || (!S_ISREG(st.st_mode))) return false;
+    std::vector<char>buf(4096);
+#if defined(__APPLE__)
+    if(fcntl(fileno(stdin), F_GETPATH, buf.data()) == -1) return false;
+#else
+    ssize_t len = readlink("/proc/self/fd/0", buf.data(), buf.size() - 1);
+    if((len <= 0) || (len >= (ssize_t)buf.size() - 1)) return false;
+    buf[len] = 0;
+#endif
+    path = buf.data();
+    return access(path.c_str(), R_OK) == 0;
+#endif
+}
+
+#if defined(LIBPFF_HAVE_BFIO)
+static void read_stdin(std::vector<uint8_t>& data) {
+    
+    size_t len = 0;
+    data.resize(BUFLEN * 128);
+    for (;;) {
+        size_t n = fread(data.data() + len, 1, data.size() - len, stdin);
+        if(n == 0) break;
+        len += n;
+        if(len == data.size()) data.resize(data.size() * 2);
+    }
+    data.resize(len);
+}
+#else
+static bool spool_stdin(const arg_string& path) {
+    
+    FILE *f = _fopen(path.c_str(), _wb);
+    if(!f) return false;
+    std::vector<uint8_t>buf(BUFLEN * 128);
+    size_t len;
+    bool ok = true;
+    while ((len = fread(buf.data(), 1, buf.size(), stdin)) > 0) {
+        if(fwrite(buf.data(), 1, len, f) != len) {
+            ok = false;
+            break;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+#endif
+
+static std::string filetime_to_string(uint64_t filetime) {
+    
+    if(!filetime) return "";
+    
+    int64_t seconds = (int64_t)(filetime / 10000000) - 11644473600LL;
+    int64_t days = seconds / 86400;
+    int64_t rem = seconds % 86400;
+    if(rem < 0) {
+        rem += 86400;
+        days--;
+    }
+    /* civil date from days since 1970-01-01 */
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned int doe = (unsigned int)(days - era * 146097);
+    unsigned int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned int mp = (5 * doy + 2) / 153;
+    unsigned int d = doy - (153 * mp + 2) / 5 + 1;
+    unsigned int m = mp < 10 ? mp + 3 : mp - 9;
+    int64_t y = (int64_t)yoe + era * 400 + (m <= 2);
+    
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%04lld-%02u-%02uT%02u:%02u:%02uZ",
+             (long long)y, m, d,
+             (unsigned int)(rem / 3600), (unsigned int)(rem / 60 % 60), (unsigned int)(rem % 60));
+    return buf;
+}
+
+static Json::Value json_string(std::string_view value) {
+    if(!value.length()) return Json::Value("");
+    return Json::Value(value.data(), value.data() + value.length());
+}
+
+static Json::Value account_to_json(const Account& account, const StringPool& pool) {
+    
+    Json::Value accountNode(Json::objectValue);
+    accountNode["name"] = json_string(pool.get(account.name));
+    accountNode["address"] = json_string(pool.get(account.address));
+    return accountNode;
+}
+
+static Json::Value accounts_to_json(const AccountTable& accounts, const StringPool& pool) {
+    
+    Json::Value accountsNode(Json::arrayValue);
+    for (const auto &account : accounts.accounts()) {
+        accountsNode.append(account_to_json(account, pool));
+    }
+    return accountsNode;
+}
+
+/* with an AccountTable, sender and recipient are indexes into it */
+/* an embedded message has the fields of a message, without the keys about its place in the document */
+static Json::Value message_to_json(const Message& message, const Context& context, AccountTable *accounts, bool embedded = false) {
+    
+    unsigned int fields = context.fields;
+    Json::Value messageNode(Json::objectValue);
+    if(((context.manifest) || (context.ids)) && (!embedded)) {
+        messageNode["id"] = message.id;
+    }
+    if((context.manifest) && (!embedded)) {
+        messageNode["status"] = message.status == Message::NEW ? "new" : "changed";
+    }
+    if((context.dedup) && (context.dedup->mode == Dedup::REF) && (!embedded)) {
+        if(message.duplicate) {
+            messageNode["duplicate"] = hash_to_string(message.hash);
+            return messageNode;
+        }
+        messageNode["hash"] = hash_to_string(message.hash);
+    }
+    if(fields & FIELD_SUBJECT) {
+        messageNode["subject"] = json_string(message.subject);
+    }
+    if(fields & FIELD_TEXT) {
+        messageNode["text"] = json_string(message.text);
+    }
+    if(fields & FIELD_HTML) {
+        messageNode["html"] = json_string(message.html);
+    }
+    if(fields & FIELD_TIME) {
+        messageNode["time"] = filetime_to_string(message.time);
+    }
+    if(fields & FIELD_SENDER) {
+        if(accounts) {
+            messageNode["sender"] = accounts->index(message.sender);
+        }else{
+            messageNode["sender"] = account_to_json(message.sender, *context.pool);
+        }
+    }
+    if(fields & FIELD_RECIPIENTS) {
+        if(accounts) {
+            messageNode["recipient"] = accounts->index(message.recipient);
+        }else{
+            messageNode["recipient"] = account_to_json(message.recipient, *context.pool);
+        }
+    }
+    if(context.attachments) {
+        Json::Value attachmentsNode(Json::arrayValue);
+        for (const auto &attachment : message.attachments) {
+            Json::Value attachmentNode(Json::objectValue);
+            attachmentNode["name"] = json_string(attachment.name);
+            attachmentNode["size"] = (Json::UInt64)attachment.size;
+            attachmentNode["sha256"] = digest_to_string(attachment.sha256);
+            attachmentNode["file"] = json_string(attachment.file);
+            attachmentsNode.append(std::move(attachmentNode));
+        }
+        messageNode["attachments"] = std::move(attachmentsNode);
+    }
+    if(context.embedded) {
+        Json::Value embeddedNode(Json::arrayValue);
+        for (const auto &child : message.embedded) {
+            embeddedNode.append(message_to_json(child, context, accounts, true));
+        }
+        messageNode["embedded"] = std::move(embeddedNode);
+    }
+    return messageNode;
+}
+
+static void __(Folder& folder, Json::Value& folders, const Context& context, AccountTable *accounts){
+
+    Json::Value folderNode(Json::objectValue);
+    folderNode["name"] = folder.name;
+    
+    /* subfolders first, as they are read, so that --senders indexes match the streaming writer */
+    Json::Value foldersNode(Json::arrayValue);
+    for (auto &_folder : folder.folders) {
+        __(_folder, foldersNode, context, accounts);
+    }
+    folderNode["folders"] = std::move(foldersNode);
+    
+    Json::Value messagesNode(Json::arrayValue);
+    for (const auto &message : folder.messages) {
+        messagesNode.append(message_to_json(message, context, accounts));
+    }
+    folderNode["messages"] = std::move(messagesNode);
+    folders.append(std::move(folderNode));
+}
+
+static void document_to_json(Document& document, std::string& text, const Context& context) {
+    
+    Json::Value documentNode(Json::objectValue);
+    documentNode["type"] = document.type;
+            
+    AccountTable accounts;
+    Json::Value foldersNode(Json::arrayValue);
+    for (auto &folder : document.folders) {
+        __(folder, foldersNode, context, context.senders ? &accounts : NULL);
+    }
+    documentNode["folders"] = std::move(foldersNode);
+    if(context.senders) {
+        documentNode["senders"] = accounts_to_json(accounts, *context.pool);
+    }
+    if(context.manifest) {
+        Json::Value removedNode(Json::arrayValue);
+        for (uint32_t id : document.removed) {
+            removedNode.append(id);
+        }
+        documentNode["removed"] = std::move(removedNode);
+    }
+    
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "";
+    text = Json::writeString(writer, documentNode);
+}
+
+/*
+ * output sink: buffers small writes so that streaming writers
+ * do not pay one fwrite per token
+ */
+class Sink {
+    FILE *_f;
+    bool _close;
+    std::vector<char> _buf;
+    size_t _len;
+    uint64_t _offset;
+    std::mutex _mutex;
+public:
+    /* offset is where an appended file already ends */
+    Sink(FILE *f, bool close, uint64_t offset = 0) : _f(f), _close(close), _buf(BUFLEN * 128), _len(0), _offset(offset) {}
+    ~Sink() {
+        flush();
+        if((_f) && (_close)) fclose(_f);
+    }
+    void write(const char *data, size_t size) {
+        if(!size) return;
+        if(_len + size > _buf.size()) {
+            flush();
+            if(size > _buf.size()) {
+                Timer timer(stats.write_ns);
+                fwrite(data, 1, size, _f);
+                stats.bytes_written += size;
+                _offset += size;
+                return;
+            }
+        }
+        memcpy(_buf.data() + _len, data, size);
+        _len += size;
+    }
+    void write(std::string_view data) {
+        write(data.data(), data.length());
+    }
+    /* a whole line, flushed; batch workers share one sink */
+    void write_record(std::string_view record) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        write(record);
+        flush();
+    }
+    void flush() {
+        Timer timer(stats.write_ns);
+        if(_len) {
+            fwrite(_buf.data(), 1, _len, _f);
+            stats.bytes_written += _len;
+            _offset += _len;
+            _len = 0;
+        }
+        fflush(_f);
+    }
+    /* bytes written so far, buffered or not */
+    uint64_t offset() const {
+        return _offset + _len;
+    }
+};
+
+/*
+ * traversal events; subfolders are visited before the messages of a folder
+ * so that streaming output keeps the key order of the json tree writer;
+ * messages are read into arena(), which a streaming writer clears once
+ * the message is written
+ */
+class Writer {
+protected:
+    Arena _arena;
+public:
+    virtual ~Writer() {}
+    /* index is the position of the folder in its parent, for checkpoints */
+    virtual void begin_folder(const std::string& name, int index) = 0;
+    virtual void message(Message&& message) = 0;
+    virtual void end_folder() = 0;
+    /* a message dropped before message() was called; its bytes are in arena() */
+    virtual void discard() = 0;
+    virtual Arena& arena() {
+        return _arena;
+    }
+    /* messages read into another arena are handed over with it; writers that do not keep messages free it */
+    virtual void adopt(Arena&& arena) {
+        Arena released(std::move(arena));
+    }
+    /* --manifest: a message of the last run that is gone */
+    virtual void removed(uint32_t) {}
+};
+
+/* builds the in-memory Document model; each folder owns the bytes of its messages */
+class DocumentWriter : public Writer {
+    Document& _document;
+    std::vector<Folder *> _folders;
+public:
+    DocumentWriter(Document& document) : _document(document) {}
+    Arena& arena() {
+        return _folders.back()->arena;
+    }
+    void adopt(Arena&& arena) {
+        _folders.back()->arena.absorb(std::move(arena));
+    }
+    void begin_folder(const std::string& name, int) {
+        std::vector<Folder>& folders = _folders.size() ? _folders.back()->folders : _document.folders;
+        folders.push_back(Folder());
+        folders.back().name = name;
+        _folders.push_back(&folders.back());
+    }
+    void message(Message&& message) {
+        _folders.back()->messages.push_back(std::move(message));
+    }
+    void end_folder() {
+        _folders.pop_back();
+    }
+    /* the bytes stay with the folder until the document is freed */
+    void discard() {}
+    void removed(uint32_t id) {
+        _document.removed.push_back(id);
+    }
+};
+
+/* writes the same json as document_to_json, one message at a time */
+class JsonWriter : public Writer {
+    struct Level {
+        std::string name;
+        bool has_folders;
+        bool has_messages;
+        bool in_messages;
+    };
+    Sink& _sink;
+    std::string _type;
+    const Context& _context;
+    AccountTable _accounts;
+    std::vector<Level> _levels;
+    std::vector<uint32_t> _removed;
+    bool _has_folders;
+    Json::StreamWriterBuilder _builder;
+    std::string quote(const std::string& value) {
+        return Json::writeString(_builder, Json::Value(value));
+    }
+    void begin_messages(Level& level) {
+        if(!level.in_messages) {
+            _sink.write("],\"messages\":[");
+            level.in_messages = true;
+        }
+    }
+public:
+    JsonWriter(Sink& sink, const std::string& type, const Context& context) : _sink(sink), _type(type), _context(context), _has_folders(false) {
+        _builder["indentation"] = "";
+        _sink.write("{\"folders\":[");
+    }
+    ~JsonWriter() {
+        _sink.write("]");
+        if(_context.manifest) {
+            _sink.write(",\"removed\":[");
+            for (size_t i = 0; i < _removed.size(); ++i) {
+                if(i) _sink.write(",");
+                _sink.write(std::to_string(_removed[i]));
+            }
+            _sink.write("]");
+        }
+        if(_context.senders) {
+            _sink.write(",\"senders\":");
+            _sink.write(Json::writeString(_builder, accounts_to_json(_accounts, *_context.pool)));
+        }
+        _sink.write(",\"type\":");
+        _sink.write(quote(_type));
+        _sink.write("}");
+    }
+    void begin_folder(const std::string& name, int) {
+        bool& has_folders = _levels.size() ? _levels.back().has_folders : _has_folders;
+        if(has_folders) _sink.write(",");
+        has_folders = true;
+        _sink.write("{\"folders\":[");
+        _levels.push_back({name, false, false, false});
+    }
+    void message(Message&& message) {
+        Level& level = _levels.back();
+        begin_messages(level);
+        if(level.has_messages) _sink.write(",");
+        level.has_messages = true;
+        std::string text;
+        {
+            Timer timer(stats.serialization_ns);
+            text = Json::writeString(_builder, message_to_json(message, _context, _context.senders ? &_accounts : NULL));
+        }
+        _sink.write(text);
+        _arena.clear();
+    }
+    void end_folder() {
+        Level& level = _levels.back();
+        begin_messages(level);
+        _sink.write("],\"name\":");
+        _sink.write(quote(level.name));
+        _sink.write("}");
+        _levels.pop_back();
+    }
+    void discard() {
+        _arena.clear();
+    }
+    void removed(uint32_t id) {
+        _removed.push_back(id);
+    }
+};
+
+/* one self-contained json object per line, flushed as it is written */
+class NdjsonWriter : public Writer {
+    Sink& _sink;
+    const Context& _context;
+    AccountTable _accounts;
+    std::string _file;
+    std::vector<std::string> _path;
+    Json::StreamWriterBuilder _builder;
+    /* with --senders an account line {"index","sender"} comes before its first use */
+    void define(const Account& account, std::string& text) {
+        bool added = false;
+        uint32_t index = _accounts.index(account, &added);
+        if(added) {
+            Json::Value accountNode(Json::objectValue);
+            accountNode["index"] = index;
+            accountNode["sender"] = account_to_json(account, *_context.pool);
+            if(_file.length()) accountNode["file"] = _file;
+            text += Json::writeString(_builder, accountNode);
+            text += "\n";
+        }
+    }
+    void define(const Message& message, std::string& text) {
+        if(_context.fields & FIELD_SENDER) define(message.sender, text);
+        if(_context.fields & FIELD_RECIPIENTS) define(message.recipient, text);
+        for (const auto &child : message.embedded) {
+            define(child, text);
+        }
+    }
+public:
+    NdjsonWriter(Sink& sink, const Context& context, const std::string& file = "") : _sink(sink), _context(context), _file(file) {
+        _builder["indentation"] = "";
+    }
+    void begin_folder(const std::string& name, int) {
+        _path.push_back(_path.size() ? _path.back() + "/" + name : name);
+    }
+    void message(Message&& message) {
+        std::string text;
+        {
+            Timer timer(stats.serialization_ns);
+            if(_context.senders) define(message, text);
+            Json::Value messageNode = message_to_json(message, _context, _context.senders ? &_accounts : NULL);
+            messageNode["folder"] = _path.back();
+            if(_file.length()) messageNode["file"] = _file;
+            text += Json::writeString(_builder, messageNode);
+        }
+        text += "\n";
+        _sink.write_record(text);
+        _arena.clear();
+    }
+    void end_folder() {
+        _path.pop_back();
+    }
+    void discard() {
+        _arena.clear();
+    }
+    void removed(uint32_t id) {
+        Json::Value removedNode(Json::objectValue);
+        removedNode["id"] = id;
+        removedNode["status"] = "removed";
+        if(_file.length()) removedNode["file"] = _file;
+        _sink.write_record(Json::writeString(_builder, removedNode) + "\n");
+    }
+};
+
+/*
+ * raw text: the selected fields of each message, written as soon as it is read;
+ * empty delimiters give the old concatenated output
+ */
+class RawWriter : public Writer {
+    Sink& _sink;
+    const Context& _context;
+    std::string _field_delimiter;
+    std::string _record_delimiter;
+    bool _first;
+    void field(std::string_view value) {
+        if(!_first) _sink.write(_field_delimiter);
+        _first = false;
+        _sink.write(value);
+    }
+    /* an embedded message is one more record after its parent */
+    void record(const Message& message) {
+        _first = true;
+        unsigned int fields = _context.fields;
+        if(fields & FIELD_SENDER) {
+            field(_context.pool->get(message.sender.name));
+            field(_context.pool->get(message.sender.address));
+        }
+        if(fields & FIELD_RECIPIENTS) {
+            field(_context.pool->get(message.recipient.name));
+            field(_context.pool->get(message.recipient.address));
+        }
+        if(fields & FIELD_SUBJECT) {
+            field(message.subject);
+        }
+        if(fields & FIELD_TEXT) {
+            field(message.text);
+        }
+        if(fields & FIELD_HTML) {
+            field(message.html);
+        }
+        _sink.write(_record_delimiter);
+        for (const auto &child : message.embedded) {
+            record(child);
+        }
+    }
+public:
+    RawWriter(Sink& sink, const Context& context, const std::string& field_delimiter, const std::string& record_delimiter)
+    : _sink(sink), _context(context), _field_delimiter(field_delimiter), _record_delimiter(record_delimiter), _first(true) {}
+    void begin_folder(const std::string&, int) {}
+    void message(Message&& message) {
+        if(!message.duplicate) record(message);
+        _arena.clear();
+    }
+    void end_folder() {}
+    void discard() {
+        _arena.clear();
+    }
+};
+
+/* marks repeated messages; with --dedup skip they never reach the output */
+class DedupWriter : public Writer {
+    Writer& _writer;
+    Dedup& _dedup;
+public:
+    DedupWriter(Writer& writer, Dedup& dedup) : _writer(writer), _dedup(dedup) {}
+    void begin_folder(const std::string& name, int index) {
+        _writer.begin_folder(name, index);
+    }
+    void message(Message&& message) {
+        message.duplicate = !_dedup.insert(message.hash);
+        if((message.duplicate) && (_dedup.mode == Dedup::SKIP)) {
+            _writer.discard();
+            return;
+        }
+        _writer.message(std::move(message));
+    }
+    void end_folder() {
+        _writer.end_folder();
+    }
+    void discard() {
+        _writer.discard();
+    }
+    Arena& arena() {
+        return _writer.arena();
+    }
+    void adopt(Arena&& arena) {
+        _writer.adopt(std::move(arena));
+    }
+    void removed(uint32_t id) {
+        _writer.removed(id);
+    }
+};
+
+/* records every message in the new manifest; only new and changed ones are written */
+class ManifestWriter : public Writer {
+    Writer& _writer;
+    Manifest& _manifest;
+public:
+    ManifestWriter(Writer& writer, Manifest& manifest) : _writer(writer), _manifest(manifest) {}
+    void begin_folder(const std::string& name, int index) {
+        _writer.begin_folder(name, index);
+    }
+    void message(Message&& message) {
+        if(message.id) _manifest.add(message.id, message.modified, message.content);
+        if(message.status == Message::UNCHANGED) {
+            _writer.discard();
+            return;
+        }
+        _writer.message(std::move(message));
+    }
+    void end_folder() {
+        _writer.end_folder();
+    }
+    void discard() {
+        _writer.discard();
+    }
+    Arena& arena() {
+        return _writer.arena();
+    }
+    void adopt(Arena&& arena) {
+        _writer.adopt(std::move(arena));
+    }
+};
+
+/*
+ * --checkpoint: every CHECKPOINT_MESSAGES messages the output is flushed and
+ * the position of the next message is saved with the output offset;
+ * folders are sub folder indices from the root
+ */
+#define CHECKPOINT_MESSAGES 1000
+
+struct Resume {
+    std::vector<int> folders;
+    int message;
+    uint64_t offset;
+};
+
+static bool load_checkpoint(const OPTARG_T path, Resume& resume) {
+
+    std::ifstream in{std::filesystem::path(path), std::ios::binary};
+    if(!in) return false;
+    Json::CharReaderBuilder builder;
+    Json::Value checkpointNode;
+    std::string errors;
+    if((!Json::parseFromStream(builder, in, &checkpointNode, &errors)) || (!checkpointNode.isObject())) {
+        return false;
+    }
+    /* positions index folders and messages, so a hand-edited one must still be in range */
+    const Json::Value& foldersNode = checkpointNode["folders"];
+    if((!foldersNode.isArray()) || (!foldersNode.size())) return false;
+    for (const auto &folderNode : foldersNode) {
+        if((!folderNode.isInt()) || (folderNode.asInt() < 0)) return false;
+        resume.folders.push_back(folderNode.asInt());
+    }
+    const Json::Value& messageNode = checkpointNode["message"];
+    const Json::Value& offsetNode = checkpointNode["offset"];
+    if((!messageNode.isInt()) || (messageNode.asInt() < 0) || (!offsetNode.isUInt64())) return false;
+    resume.message = messageNode.asInt();
+    resume.offset = offsetNode.asUInt64();
+    return true;
+}
+
+class CheckpointWriter : public Writer {
+    Writer& _writer;
+    Sink& _sink;
+    std::filesystem::path _path;
+    std::vector<int> _folders;
+    std::vector<std::string> _names;
+    unsigned int _count;
+    void save(int message) {
+        _sink.flush();
+        Json::Value checkpointNode(Json::objectValue);
+        Json::Value foldersNode(Json::arrayValue);
+        for (int index : _folders) {
+            foldersNode.append(index);
+        }
+        checkpointNode["folders"] = std::move(foldersNode);
+        checkpointNode["folder"] = _names.back();
+        checkpointNode["message"] = message;
+        checkpointNode["offset"] = (Json::UInt64)_sink.offset();
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        /* written aside and renamed, so a crash never leaves half a checkpoint */
+        std::filesystem::path temp = _path;
+        temp += ".tmp";
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            out << Json::writeString(builder, checkpointNode) << "\n";
+            if(!out) return;
+        }
+        std::error_code ec;
+        std::filesystem::rename(temp, _path, ec);
+    }
+public:
+    CheckpointWriter(Writer& writer, Sink& sink, const OPTARG_T path) : _writer(writer), _sink(sink), _path(path), _count(0) {}
+    void begin_folder(const std::string& name, int index) {
+        _folders.push_back(index);
+        _names.push_back(_names.size() ? _names.back() + "/" + name : name);
+        _writer.begin_folder(name, index);
+    }
+    void message(Message&& message) {
+        int index = message.index;
+        _writer.message(std::move(message));
+        if(++_count == CHECKPOINT_MESSAGES) {
+            _count = 0;
+            save(index + 1);
+        }
+    }
+    void end_folder() {
+        _folders.pop_back();
+        _names.pop_back();
+        _writer.end_folder();
+    }
+    void discard() {
+        _writer.discard();
+    }
+    Arena& arena() {
+        return _writer.arena();
+    }
+    void adopt(Arena&& arena) {
+        _writer.adopt(std::move(arena));
+    }
+    void removed(uint32_t id) {
+        _writer.removed(id);
+    }
+};
+
+/*
+ * owning wrappers for libpff handles; release() is called with a NULL
+ * error because there is nothing left to do with a failure at that point
+ */
+template<typename T, typename Release>
+class Handle {
+    T *_ptr;
+public:
+    Handle() : _ptr(NULL) {}
+    ~Handle() {
+        reset();
+    }
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    Handle(Handle&& other) : _ptr(other._ptr) {
+        other._ptr = NULL;
+    }
+    Handle& operator=(Handle&& other) {
+        if(this != std::addressof(other)) {
+            reset();
+            _ptr = other._ptr;
+            other._ptr = NULL;
+        }
+        return *this;
+    }
+    operator T *() const {
+        return _ptr;
+    }
+    T **operator&() {
+        reset();
+        return &_ptr;
+    }
+    void reset() {
+        if(_ptr) Release()(&_ptr);
+        _ptr = NULL;
+    }
+};
+
+struct FileRelease {
+    void operator()(libpff_file_t **file) const { libpff_file_free(file, NULL); }
+};
+struct ItemRelease {
+    void operator()(libpff_item_t **item) const { libpff_item_free(item, NULL); }
+};
+struct RecordSetRelease {
+    void operator()(libpff_record_set_t **record_set) const { libpff_record_set_free(record_set, NULL); }
+};
+struct RecordEntryRelease {
+    void operator()(libpff_record_entry_t **record_entry) const { libpff_record_entry_free(record_entry, NULL); }
+};
+/* every error that was raised is freed exactly once, so this is where they are counted */
+struct ErrorRelease {
+    void operator()(libpff_error_t **error) const {
+        stats.errors++;
+        libpff_error_free(error);
+    }
+};
+
+typedef Handle<libpff_file_t, FileRelease> FileHandle;
+typedef Handle<libpff_item_t, ItemRelease> ItemHandle;
+typedef Handle<libpff_record_set_t, RecordSetRelease> RecordSetHandle;
+typedef Handle<libpff_record_entry_t, RecordEntryRelease> RecordEntryHandle;
+/* &error frees the previous error, so one handle can be passed to every call */
+typedef Handle<libpff_error_t, ErrorRelease> ErrorHandle;
+
+#if defined(LIBPFF_HAVE_BFIO)
+struct BfioRelease {
+    void operator()(libbfio_handle_t **handle) const { libbfio_handle_free(handle, NULL); }
+};
+typedef Handle<libbfio_handle_t, BfioRelease> BfioHandle;
+#endif
+
+#if !defined(LIBPFF_HAVE_BFIO)
+static uint64_t physical_memory() {
+    
+#if defined(_WIN32)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    return GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return (pages > 0) && (page_size > 0) ? (uint64_t)pages * (uint64_t)page_size : 0;
+#endif
+}
+#endif
+
+/*
+ * read-only mapping of the input; with libbfio libpff reads the pages
+ * directly, without it the mapping only asks the kernel to fault the
+ * file into the page cache ahead of libpff's own reads, and only for a
+ * file that fits in half the physical memory: a larger one would evict
+ * its own pages before libpff reads them
+ */
+class Mapping {
+    const uint8_t *_data;
+    size_t _size;
+#if defined(_WIN32)
+    HANDLE _file;
+    HANDLE _map;
+#endif
+public:
+    Mapping() : _data(NULL), _size(0)
+#if defined(_WIN32)
+    , _file(INVALID_HANDLE_VALUE), _map(NULL)
+#endif
+    {}
+    ~Mapping() {
+#if defined(_WIN32)
+        if(_data) UnmapViewOfFile(_data);
+        if(_map) CloseHandle(_map);
+        if(_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+#else
+        if(_data) munmap((void *)_data, _size);
+#endif
+    }
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+#if !defined(LIBPFF_HAVE_BFIO)
+    bool prefetch() const {
+        uint64_t memory = physical_memory();
+        if((memory) && (_size > memory / 2)) {
+            std::cerr << "Input larger than half the memory, not prefetched" << std::endl;
+            return false;
+        }
+        return true;
+    }
+#endif
+    
+    bool map(const OPTARG_T path) {
+#if defined(_WIN32)
+        _file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+        if(_file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if((!GetFileSizeEx(_file, &size)) || (size.QuadPart == 0)) return false;
+        _map = CreateFileMappingW(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(!_map) return false;
+        _data = (const uint8_t *)MapViewOfFile(_map, FILE_MAP_READ, 0, 0, 0);
+        if(!_data) return false;
+        _size = (size_t)size.QuadPart;
+#if !defined(LIBPFF_HAVE_BFIO)
+        if(prefetch()) {
+            WIN32_MEMORY_RANGE_ENTRY range = {(PVOID)_data, _size};
+            PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+        }
+#endif
+#else
+        int fd = open(path, O_RDONLY);
+        if(fd == -1) return false;
+        struct stat st;
+        if((fstat(fd, &st) != 0) || (!S_ISREG(st.st_mode)) || (st.st_size == 0)) {
+            close(fd);
+            return false;
+        }
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED) return false;
+        _data = (const uint8_t *)data;
+        _size = (size_t)st.st_size;
+#if defined(LIBPFF_HAVE_BFIO)
+        /* b-tree pages are visited out of order */
+        madvise(data, _size, MADV_RANDOM);
+#else
+        if(prefetch()) madvise(data, _size, MADV_WILLNEED);
+#endif
+#endif
+        return true;
+    }
+    const uint8_t *data() const { return _data; }
+    size_t size() const { return _size; }
+};
+
+/* owns the io handle a file reads from; declare it before the FileHandle */
+struct Input {
+#if defined(LIBPFF_HAVE_BFIO)
+    BfioHandle io;
+#endif
+};
+
+static int open_input(const Context& context, Input& input, libpff_file_t *file, libpff_error_t **error) {
+    
+#if defined(LIBPFF_HAVE_BFIO)
+    if(context.memory) {
+        if(libbfio_memory_range_initialize(&input.io, (libbfio_error_t **)error) != 1) return -1;
+        if(libbfio_memory_range_set(input.io, (uint8_t *)context.memory, context.memory_size, (libbfio_error_t **)error) != 1) return -1;
+        return libpff_file_open_file_io_handle(file, input.io, LIBPFF_OPEN_READ, error);
+    }
+#else
+    (void)input;
+#endif
+    return _libpff_file_open(file, context.filename, LIBPFF_OPEN_READ, error);
+}
+
+/*
+ * unicode strings are decoded straight from the record entry into a
+ * per-thread buffer; ascii strings go through the message so that
+ * the message codepage is applied; without an arena the value points
+ * into that buffer until the next call
+ */
+static bool get_entry_string(libpff_item_t *message,
+                             libpff_record_entry_t *record_entry,
+                             uint32_t entry_type,
+                             Arena *arena,
+                             std::string_view& value,
+                             char strip = 0) {
+    
+    static thread_local std::vector<uint8_t> buf(BUFLEN);
+    
+    ErrorHandle error;
+    bool ok = false;
+    uint32_t value_type = 0;
+    size_t utf8_string_size = 0;
+    if(libpff_record_entry_get_value_type(record_entry, &value_type, &error) == 1){
+        if(value_type == LIBPFF_VALUE_TYPE_STRING_UNICODE) {
+            if(libpff_record_entry_get_data_as_utf8_string_size(record_entry, &utf8_string_size, &error) == 1){
+                if(buf.size() < utf8_string_size + 1) buf.resize(utf8_string_size + 1);
+                if(libpff_record_entry_get_data_as_utf8_string(record_entry, buf.data(), buf.size(), &error) == 1){
+                    ok = true;
+                }
+            }
+        }else{
+            if(libpff_message_get_entry_value_utf8_string_size(message, entry_type, &utf8_string_size, &error) == 1){
+                if(buf.size() < utf8_string_size + 1) buf.resize(utf8_string_size + 1);
+                if(libpff_message_get_entry_value_utf8_string(message, entry_type, buf.data(), buf.size(), &error) == 1){
+                    ok = true;
+                }
+            }
+        }
+    }
+    if(ok) {
+        char *begin = (char *)buf.data();
+        char *end = begin + strnlen(begin, utf8_string_size);
+        if(strip) end = std::remove(begin, end, strip);
+        value = arena ? arena->copy(begin, end - begin) : std::string_view(begin, end - begin);
+        stats.bytes_decoded += value.length();
+    }
+    return ok;
+}
+
+static bool get_entry_binary(libpff_item_t *message,
+                             libpff_record_entry_t *record_entry,
+                             uint32_t entry_type,
+                             Arena& arena,
+                             std::string_view& value) {
+    
+    ErrorHandle error;
+    bool ok = false;
+    uint32_t value_type = 0;
+    size_t data_size = 0;
+    if(libpff_record_entry_get_value_type(record_entry, &value_type, &error) == 1){
+        if(value_type == LIBPFF_VALUE_TYPE_BINARY_DATA) {
+            if((libpff_record_entry_get_data_size(record_entry, &data_size, &error) == 1) && (data_size)){
+                char *data = arena.allocate(data_size);
+                if(libpff_record_entry_get_data(record_entry, (uint8_t *)data, data_size, &error) == 1){
+                    value = std::string_view(data, strnlen(data, data_size));
+                    stats.bytes_decoded += value.length();
+                    ok = true;
+                }
+            }
+        }else{
+            ok = get_entry_string(message, record_entry, entry_type, &arena, value);
+        }
+    }
+    return ok;
+}
+
+/*
+ * compressed rtf (MS-OXRTFCP): LZ77 over a 4096-byte dictionary primed
+ * with a fixed rtf prefix; "MELA" bodies are stored as they are
+ */
+#define RTF_COMPRESSED   0x75465a4c
+#define RTF_UNCOMPRESSED 0x414c454d
+#define RTF_DICTIONARY   4096
+
+static const char rtf_prebuf[] =
+"{\\rtf1\\ansi\\mac\\deff0\\deftab720{\\fonttbl;}{\\f0\\fnil \\froman \\fswiss \\fmodern \\fscript \\fdecor "
+"MS Sans SerifSymbolArialTimes New RomanCourier{\\colortbl\\red0\\green0\\blue0\r\n\\par \\pard\\plain\\f0\\fs20\\b\\i\\u\\tab\\tx";
+
+static uint32_t read_uint32(const uint8_t *p) {
+    
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool decompress_rtf(const uint8_t *data, size_t size, std::string& rtf) {
+    
+    rtf.clear();
+    if(size < 16) return false;
+    size_t comp_size = read_uint32(data) + 4;
+    size_t raw_size = read_uint32(data + 4);
+    uint32_t magic = read_uint32(data + 8);
+    const uint8_t *p = data + 16;
+    const uint8_t *end = data + std::min(size, comp_size);
+    if(p > end) return false;
+    if(magic == RTF_UNCOMPRESSED) {
+        rtf.assign((const char *)p, std::min((size_t)(end - p), raw_size));
+        return true;
+    }
+    if(magic != RTF_COMPRESSED) return false;
+    /* a reference is 2 bytes for at most 17, so raw_size can not be trusted further */
+    rtf.resize(std::min(raw_size, (size_t)(end - p) * 9));
+    char *out = &rtf[0];
+    size_t len = 0;
+    size_t cap = rtf.size();
+    char dictionary[RTF_DICTIONARY] = {0};
+    size_t write = sizeof(rtf_prebuf) - 1;
+    memcpy(dictionary, rtf_prebuf, write);
+    while((p < end) && (len < cap)) {
+        uint8_t control = *p++;
+        for (int bit = 0; (bit < 8) && (p < end) && (len < cap); ++bit) {
+            if(control & (1 << bit)) {
+                if(end - p < 2) break;
+                size_t offset = (p[0] << 4) | (p[1] >> 4);
+                size_t count = (p[1] & 0x0F) + 2;
+                p += 2;
+                if(offset == write) {
+                    rtf.resize(len);
+                    return true;
+                }
+                for (size_t i = 0; (i < count) && (len < cap); ++i) {
+                    char c = dictionary[(offset + i) & (RTF_DICTIONARY - 1)];
+                    out[len++] = c;
+                    dictionary[write] = c;
+                    write = (write + 1) & (RTF_DICTIONARY - 1);
+                }
+            }else{
+                char c = (char)*p++;
+                out[len++] = c;
+                dictionary[write] = c;
+                write = (write + 1) & (RTF_DICTIONARY - 1);
+            }
+        }
+    }
+    rtf.resize(len);
+    return true;
+}
+
+static void append_utf8(std::string& text, uint32_t c) {
+    
+    if(c < 0x80) {
+        text += (char)c;
+    }else if(c < 0x800) {
+        text += (char)(0xC0 | (c >> 6));
+        text += (char)(0x80 | (c & 0x3F));
+    }else if(c < 0x10000) {
+        text += (char)(0xE0 | (c >> 12));
+        text += (char)(0x80 | ((c >> 6) & 0x3F));
+        text += (char)(0x80 | (c & 0x3F));
+    }else{
+        text += (char)(0xF0 | (c >> 18));
+        text += (char)(0x80 | ((c >> 12) & 0x3F));
+        text += (char)(0x80 | ((c >> 6) & 0x3F));
+        text += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+#if !defined(_WIN32)
+/* iconv descriptors by codepage, for the life of a thread */
+struct Converters : std::unordered_map<int, iconv_t> {
+    ~Converters() {
+        for (auto &converter : *this) {
+            if(converter.second != (iconv_t)-1) iconv_close(converter.second);
+        }
+    }
+};
+#endif
+
+#if !defined(_WIN32)
+static std::string codepage_name(int codepage) {
+    
+    switch (codepage) {
+        case 1200:  return "UTF-16LE";
+        case 1201:  return "UTF-16BE";
+        case 10000: return "MACINTOSH";
+        case 20866: return "KOI8-R";
+        case 20932: return "EUC-JP";
+        case 21866: return "KOI8-U";
+        case 50220:
+        case 50221:
+        case 50222: return "ISO-2022-JP";
+        case 50225: return "ISO-2022-KR";
+        case 54936: return "GB18030";
+        default:
+            if((codepage > 28590) && (codepage < 28606)) return "ISO-8859-" + std::to_string(codepage - 28590);
+            return "CP" + std::to_string(codepage);
+    }
+}
+#endif
+
+/* bytes in a windows codepage, appended as utf-8; latin-1 if the codepage is unknown */
+static void append_codepage(std::string& text, int codepage, std::string_view bytes) {
+    
+    if(codepage == 65001) {
+        text.append(bytes);
+        return;
+    }
+#if defined(_WIN32)
+    static thread_local std::wstring wide;
+    int len = MultiByteToWideChar(codepage, 0, bytes.data(), (int)bytes.length(), NULL, 0);
+    if(len) {
+        wide.resize(len);
+        MultiByteToWideChar(codepage, 0, bytes.data(), (int)bytes.length(), &wide[0], len);
+        int size = WideCharToMultiByte(CP_UTF8, 0, wide.c_str(), len, NULL, 0, NULL, NULL);
+        size_t offset = text.length();
+        text.resize(offset + size);
+        if(size) WideCharToMultiByte(CP_UTF8, 0, wide.c_str(), len, &text[offset], size, NULL, NULL);
+        return;
+    }
+#else
+    static thread_local Converters converters;
+    auto it = converters.find(codepage);
+    if(it == converters.end()) {
+        it = converters.emplace(codepage, iconv_open("UTF-8", codepage_name(codepage).c_str())).first;
+    }
+    if(it->second != (iconv_t)-1) {
+        char buf[BUFLEN];
+        char *in = (char *)bytes.data();
+        size_t in_left = bytes.length();
+        while(in_left) {
+            char *out = buf;
+            size_t out_left = sizeof(buf);
+            size_t r = iconv(it->second, &in, &in_left, &out, &out_left);
+            text.append(buf, out - buf);
+            if((r == (size_t)-1) && (errno != E2BIG)) {
+                /* a byte with no mapping, or a lead byte without its trail */
+                text += '?';
+                in++;
+                in_left--;
+                iconv(it->second, NULL, NULL, NULL, NULL);
+            }
+        }
+        return;
+    }
+#endif
+    for (unsigned char c : bytes) {
+        append_utf8(text, c);
+    }
+}
+
+static int charset_codepage(int charset) {
+    
+    switch (charset) {
+        case 0:   return 1252;
+        case 77:  return 10000;
+        case 128: return 932;
+        case 129: return 949;
+        case 130: return 1361;
+        case 134: return 936;
+        case 136: return 950;
+        case 161: return 1253;
+        case 162: return 1254;
+        case 163: return 1258;
+        case 177: return 1255;
+        case 178: return 1256;
+        case 186: return 1257;
+        case 204: return 1251;
+        case 222: return 874;
+        case 238: return 1250;
+        case 254: return 437;
+        default:  return 0;
+    }
+}
+
+static bool is_dbcs(int codepage) {
+    
+    return (codepage == 932) || (codepage == 936) || (codepage == 949) || (codepage == 950) || (codepage == 1361);
+}
+
+/*
+ * rtf to plain text in one pass: destinations that are not text are skipped,
+ * \'hh bytes are collected while in the same codepage (\ansicpg, or the
+ * \fcharset of the current font) and converted as a run, and \uN is followed
+ * by \ucN fallback characters that are dropped; an encapsulated html body
+ * (\fromhtml) keeps its original tags in \*\htmltag, which are ignorable
+ * destinations, so what is left is the text as rtf would render it
+ */
+class RtfText {
+    struct Group {
+        bool skip;
+        bool fonttbl;
+        int uc;
+        int codepage;
+    };
+    std::vector<Group> _groups;
+    std::unordered_map<int, int> _fonts;
+    std::string _bytes;
+    int _bytes_codepage;
+    bool _lead;
+    int _ansicpg;
+    int _font;
+    int _skip_chars;
+    uint32_t _surrogate;
+    std::string *_text;
+    
+    Group& group() {
+        return _groups.back();
+    }
+    void flush() {
+        if(_bytes.length()) {
+            append_codepage(*_text, _bytes_codepage, _bytes);
+            _bytes.clear();
+        }
+        _lead = false;
+    }
+    bool skipped() {
+        if(group().skip) return true;
+        if(_skip_chars) {
+            _skip_chars--;
+            return true;
+        }
+        return false;
+    }
+    void byte(unsigned char c) {
+        if(skipped()) return;
+        int codepage = group().codepage;
+        if((_bytes.length()) && (_bytes_codepage != codepage)) flush();
+        _bytes_codepage = codepage;
+        _bytes += (char)c;
+        if(is_dbcs(codepage)) {
+            _lead = (!_lead) && (c >= 0x81) && ((codepage != 932) || (c < 0xA1) || (c > 0xDF));
+        }
+    }
+    void character(char c) {
+        if(_lead) {
+            /* a trail byte in the ascii range is often written as it is */
+            byte((unsigned char)c);
+            return;
+        }
+        if(skipped()) return;
+        flush();
+        *_text += c;
+    }
+    void unicode(uint32_t c) {
+        if(skipped()) return;
+        flush();
+        if((c >= 0xD800) && (c < 0xDC00)) {
+            _surrogate = c;
+            return;
+        }
+        if((c >= 0xDC00) && (c < 0xE000) && (_surrogate)) {
+            c = 0x10000 + ((_surrogate - 0xD800) << 10) + (c - 0xDC00);
+        }
+        _surrogate = 0;
+        append_utf8(*_text, c);
+    }
+    int font_codepage(int font) {
+        auto it = _fonts.find(font);
+        return (it != _fonts.end()) && (it->second) ? it->second : _ansicpg;
+    }
+    void control(std::string_view word, int param) {
+        static const std::unordered_set<std::string_view> destinations = {
+            "author", "buptim", "colortbl", "comment", "creatim", "datastore", "doccomm",
+            "fldinst", "footer", "footerf", "footerl", "footerr", "footnote",
+            "ftncn", "ftnsep", "ftnsepc", "generator", "header", "headerf", "headerl",
+            "headerr", "info", "keywords", "latentstyles", "listoverridetable", "listtable",
+            "object", "operator", "pict", "printim", "private", "revtim", "rsidtbl",
+            "stylesheet", "subject", "themedata", "title", "txe", "xe", "xmlnstbl"
+        };
+        Group& g = group();
+        if(word == "bin") return;
+        if(word == "fonttbl") {
+            g.fonttbl = true;
+            g.skip = true;
+            return;
+        }
+        if(g.fonttbl) {
+            if(word == "f") {
+                _font = param;
+            }else if(word == "fcharset") {
+                _fonts[_font] = charset_codepage(param);
+            }else if(word == "cpg") {
+                _fonts[_font] = param;
+            }
+            return;
+        }
+        if(word == "ansicpg") {
+            _ansicpg = param;
+            g.codepage = font_codepage(_font);
+            return;
+        }
+        if(word == "f") {
+            _font = param;
+            g.codepage = font_codepage(param);
+            return;
+        }
+        if(word == "uc") {
+            g.uc = param;
+            return;
+        }
+        if(word == "u") {
+            unicode(param < 0 ? param + 0x10000 : param);
+            if(!g.skip) _skip_chars = g.uc;
+            return;
+        }
+        if(destinations.count(word)) {
+            g.skip = true;
+            return;
+        }
+        if(skipped()) return;
+        uint32_t c = 0;
+        if((word == "par") || (word == "line") || (word == "sect") || (word == "row") || (word == "page")) {
+            c = '\n';
+        }else if((word == "tab") || (word == "cell")) {
+            c = '\t';
+        }else if((word == "emspace") || (word == "enspace") || (word == "qmspace")) {
+            c = ' ';
+        }else if(word == "emdash") {
+            c = 0x2014;
+        }else if(word == "endash") {
+            c = 0x2013;
+        }else if(word == "bullet") {
+            c = 0x2022;
+        }else if(word == "lquote") {
+            c = 0x2018;
+        }else if(word == "rquote") {
+            c = 0x2019;
+        }else if(word == "ldblquote") {
+            c = 0x201C;
+        }else if(word == "rdblquote") {
+            c = 0x201D;
+        }
+        if(c) {
+            flush();
+            append_utf8(*_text, c);
+        }
+    }
+public:
+    void convert(std::string_view rtf, std::string& text) {
+        _groups.assign(1, Group{false, false, 1, 1252});
+        _fonts.clear();
+        _bytes.clear();
+        _lead = false;
+        _ansicpg = 1252;
+        _font = 0;
+        _skip_chars = 0;
+        _surrogate = 0;
+        _text = &text;
+        const char *p = rtf.data();
+        const char *end = p + rtf.length();
+        while(p < end) {
+            char c = *p++;
+            switch (c) {
+                case '{': {
+                    Group g = group();
+                    _groups.push_back(g);
+                    _skip_chars = 0;
+                    break;
+                }
+                case '}':
+                    _skip_chars = 0;
+                    if(_groups.size() > 1) {
+                        if(group().codepage != _groups[_groups.size() - 2].codepage) flush();
+                        _groups.pop_back();
+                    }
+                    /* nothing after the closing brace of the document */
+                    if(_groups.size() == 1) p = end;
+                    break;
+                case '\\': {
+                    if(p == end) break;
+                    c = *p++;
+                    if(isalpha((unsigned char)c)) {
+                        const char *word = p - 1;
+                        while((p < end) && (isalpha((unsigned char)*p))) p++;
+                        std::string_view name(word, p - word);
+                        bool negative = (p < end) && (*p == '-');
+                        if(negative) p++;
+                        long param = 0;
+                        while((p < end) && (isdigit((unsigned char)*p))) {
+                            if(param < 0x10000000) param = param * 10 + (*p - '0');
+                            p++;
+                        }
+                        if(negative) param = -param;
+                        if((p < end) && (*p == ' ')) p++;
+                        if(name == "bin") {
+                            /* binary data, whatever the destination */
+                            p += std::min((size_t)std::max(param, 0L), (size_t)(end - p));
+                            break;
+                        }
+                        control(name, (int)param);
+                    }else if(c == '\'') {
+                        if(end - p < 2) {
+                            p = end;
+                            break;
+                        }
+                        char hex[3] = {p[0], p[1], 0};
+                        p += 2;
+                        byte((unsigned char)strtoul(hex, NULL, 16));
+                    }else if(c == '*') {
+                        group().skip = true;
+                    }else if((c == '\\') || (c == '{') || (c == '}')) {
+                        character(c);
+                    }else if(c == '~') {
+                        unicode(0xA0);
+                    }else if(c == '_') {
+                        unicode('-');
+                    }else if((c == '\r') || (c == '\n')) {
+                        unicode('\n');
+                    }else if(c == '-') {
+                        skipped();
+                    }
+                    break;
+                }
+                case '\r':
+                case '\n':
+                    break;
+                case '\0':
+                    p = end;
+                    break;
+                default:
+                    if((unsigned char)c >= 0x80) {
+                        byte((unsigned char)c);
+                    }else{
+                        character(c);
+                    }
+                    break;
+            }
+        }
+        flush();
+    }
+};
+
+/* LIBPFF_ENTRY_TYPE_MESSAGE_BODY_COMPRESSED_RTF as text, through reusable buffers */
+static bool get_entry_rtf(libpff_record_entry_t *record_entry, Arena& arena, std::string_view& value) {
+    
+    static thread_local std::vector<uint8_t> data(BUFLEN);
+    static thread_local std::string rtf;
+    static thread_local std::string text;
+    static thread_local RtfText converter;
+    
+    ErrorHandle error;
+    size_t data_size = 0;
+    if((libpff_record_entry_get_data_size(record_entry, &data_size, &error) != 1) || (!data_size)) return false;
+    if(data.size() < data_size) data.resize(data_size);
+    if(libpff_record_entry_get_data(record_entry, data.data(), data_size, &error) != 1) return false;
+    if(!decompress_rtf(data.data(), data_size, rtf)) return false;
+    text.clear();
+    converter.convert(rtf, text);
+    value = arena.copy(text.data(), text.length());
+    stats.bytes_decoded += value.length();
+    return true;
+}
+
+/* charset names found in html, as windows codepages; 0 if unknown */
+static int charset_name_codepage(std::string_view charset) {
+    
+    static const struct {
+        const char *name;
+        int codepage;
+    } names[] = {
+        {"utf-8"         , 65001},
+        {"utf8"          , 65001},
+        {"us-ascii"      , 1252},
+        {"latin1"        , 1252},
+        {"shift_jis"     , 932},
+        {"shift-jis"     , 932},
+        {"sjis"          , 932},
+        {"x-sjis"        , 932},
+        {"windows-31j"   , 932},
+        {"euc-jp"        , 20932},
+        {"iso-2022-jp"   , 50220},
+        {"gb2312"        , 936},
+        {"gbk"           , 936},
+        {"gb18030"       , 54936},
+        {"big5"          , 950},
+        {"euc-kr"        , 949},
+        {"ks_c_5601-1987", 949},
+        {"koi8-r"        , 20866},
+        {"koi8-u"        , 21866},
+        {"utf-16"        , 1200},
+        {"utf-16le"      , 1200},
+        {"utf-16be"      , 1201},
+    };
+    
+    std::string name(charset);
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return (char)tolower(c); });
+    for (const auto &n : names) {
+        if(name == n.name) return n.codepage;
+    }
+    if(name.compare(0, 9, "iso-8859-") == 0) {
+        int part = atoi(name.c_str() + 9);
+        return part == 1 ? 1252 : (part ? 28590 + part : 0);
+    }
+    if(name.compare(0, 8, "windows-") == 0) return atoi(name.c_str() + 8);
+    if(name.compare(0, 2, "cp") == 0) return atoi(name.c_str() + 2);
+    return 0;
+}
+
+/*
+ * html to plain text in one pass, without a tree: style, script and title
+ * are dropped with their content, block elements end a line, whitespace is
+ * collapsed outside pre and entities are decoded; text runs are converted
+ * from the charset of the document as they end. encodings where '<' can be
+ * part of a character (iso-2022, utf-16) are converted to utf-8 first
+ */
+class HtmlText {
+    std::string _utf8;
+    std::string _run;
+    std::string *_text;
+    int _codepage;
+    int _pre;
+    bool _space;
+    bool _line;
+    
+    void flush() {
+        if(_run.length()) {
+            append_codepage(*_text, _codepage, _run);
+            _run.clear();
+        }
+    }
+    void space() {
+        if((_space) && (!_line)) _run += ' ';
+        _space = false;
+    }
+    void character(char c) {
+        space();
+        _run += c;
+        _line = false;
+    }
+    void unicode(uint32_t c) {
+        space();
+        flush();
+        append_utf8(*_text, c);
+        _line = false;
+    }
+    /* a block ends the current line, br always adds one */
+    void line(bool always) {
+        flush();
+        if((always) || (!_line)) *_text += '\n';
+        _line = true;
+        _space = false;
+    }
+    static bool is_block(std::string_view name) {
+        static const std::unordered_set<std::string_view> blocks = {
+            "address", "article", "aside", "blockquote", "caption", "center", "dd", "div",
+            "dl", "dt", "fieldset", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5",
+            "h6", "header", "hr", "li", "main", "nav", "ol", "p", "pre", "section", "table",
+            "tr", "ul"
+        };
+        return blocks.count(name);
+    }
+    static uint32_t entity(std::string_view name) {
+        static const char *latin1[] = {
+            "nbsp", "iexcl", "cent", "pound", "curren", "yen", "brvbar", "sect", "uml", "copy",
+            "ordf", "laquo", "not", "shy", "reg", "macr", "deg", "plusmn", "sup2", "sup3",
+            "acute", "micro", "para", "middot", "cedil", "sup1", "ordm", "raquo", "frac14",
+            "frac12", "frac34", "iquest", "Agrave", "Aacute", "Acirc", "Atilde", "Auml",
+            "Aring", "AElig", "Ccedil", "Egrave", "Eacute", "Ecirc", "Euml", "Igrave",
+            "Iacute", "Icirc", "Iuml", "ETH", "Ntilde", "Ograve", "Oacute", "Ocirc", "Otilde",
+            "Ouml", "times", "Oslash", "Ugrave", "Uacute", "Ucirc", "Uuml", "Yacute", "THORN",
+            "szlig", "agrave", "aacute", "acirc", "atilde", "auml", "aring", "aelig", "ccedil",
+            "egrave", "eacute", "ecirc", "euml", "igrave", "iacute", "icirc", "iuml", "eth",
+            "ntilde", "ograve", "oacute", "ocirc", "otilde", "ouml", "divide", "oslash",
+            "ugrave", "uacute", "ucirc", "uuml", "yacute", "thorn", "yuml"
+        };
+        static const std::unordered_map<std::string_view, uint32_t> entities = [] {
+            std::unordered_map<std::string_view, uint32_t> entities = {
+                {"quot", 34}, {"amp", 38}, {"apos", 39}, {"lt", 60}, {"gt", 62},
+                {"OElig", 338}, {"oelig", 339}, {"Scaron", 352}, {"scaron", 353},
+                {"Yuml", 376}, {"circ", 710}, {"tilde", 732}, {"ensp", 8194},
+                {"emsp", 8195}, {"thinsp", 8201}, {"ndash", 8211}, {"mdash", 8212},
+                {"lsquo", 8216}, {"rsquo", 8217}, {"sbquo", 8218}, {"ldquo", 8220},
+                {"rdquo", 8221}, {"bdquo", 8222}, {"dagger", 8224}, {"Dagger", 8225},
+                {"bull", 8226}, {"hellip", 8230}, {"permil", 8240}, {"lsaquo", 8249},
+                {"rsaquo", 8250}, {"euro", 8364}, {"trade", 8482}, {"larr", 8592},
+                {"uarr", 8593}, {"rarr", 8594}, {"darr", 8595}, {"harr", 8596}
+            };
+            for (uint32_t i = 0; i < sizeof(latin1) / sizeof(latin1[0]); ++i) {
+                entities.emplace(latin1[i], 160 + i);
+            }
+            return entities;
+        }();
+        
+        if((name.length() > 1) && (name[0] == '#')) {
+            bool hex = (name[1] == 'x') || (name[1] == 'X');
+            std::string digits(name.substr(hex ? 2 : 1));
+            char *end = NULL;
+            unsigned long c = strtoul(digits.c_str(), &end, hex ? 16 : 10);
+            if((digits.empty()) || (*end) || (!c) || (c > 0x10FFFF) || ((c >= 0xD800) && (c < 0xE000))) return 0;
+            return (uint32_t)c;
+        }
+        auto it = entities.find(name);
+        return it != entities.end() ? it->second : 0;
+    }
+    /* skips to the end of a tag, past quoted attribute values */
+    static const char *tag_end(const char *p, const char *end) {
+        char quote = 0;
+        for (; p < end; ++p) {
+            if(quote) {
+                if(*p == quote) quote = 0;
+            }else if((*p == '"') || (*p == '\'')) {
+                quote = *p;
+            }else if(*p == '>') {
+                return p + 1;
+            }
+        }
+        return end;
+    }
+    /* skips the content of style, script or title, to after its end tag */
+    static const char *skip_element(const char *p, const char *end, std::string_view name) {
+        for (; p < end; ++p) {
+            if((*p == '<') && (end - p > (ptrdiff_t)name.length() + 1) && (p[1] == '/')) {
+                bool match = true;
+                for (size_t i = 0; (i < name.length()) && (match); ++i) {
+                    match = tolower((unsigned char)p[2 + i]) == name[i];
+                }
+                if(match) return tag_end(p, end);
+            }
+        }
+        return end;
+    }
+    static int sniff_codepage(std::string_view html, int codepage) {
+        std::string_view head = html.substr(0, 4096);
+        for (size_t i = 0; i + 7 < head.length(); ++i) {
+            bool match = true;
+            for (size_t j = 0; (j < 7) && (match); ++j) {
+                match = tolower((unsigned char)head[i + j]) == "charset"[j];
+            }
+            if(!match) continue;
+            size_t j = i + 7;
+            while((j < head.length()) && (isspace((unsigned char)head[j]))) j++;
+            if((j == head.length()) || (head[j] != '=')) continue;
+            j++;
+            while((j < head.length()) && ((isspace((unsigned char)head[j])) || (head[j] == '"') || (head[j] == '\''))) j++;
+            size_t k = j;
+            while((k < head.length()) && ((isalnum((unsigned char)head[k])) || (strchr("_.:-", head[k])))) k++;
+            int found = charset_name_codepage(head.substr(j, k - j));
+            if(found) return found;
+        }
+        return codepage ? codepage : 65001;
+    }
+public:
+    /* codepage is the codepage of the body if known, or 0 */
+    void convert(std::string_view html, int codepage, std::string& text) {
+        if((html.length() >= 2) && ((uint8_t)html[0] == 0xFF) && ((uint8_t)html[1] == 0xFE)) {
+            html.remove_prefix(2);
+            codepage = 1200;
+        }else if((html.length() >= 2) && ((uint8_t)html[0] == 0xFE) && ((uint8_t)html[1] == 0xFF)) {
+            html.remove_prefix(2);
+            codepage = 1201;
+        }else if((html.length() >= 3) && (!memcmp(html.data(), "\xEF\xBB\xBF", 3))) {
+            html.remove_prefix(3);
+            codepage = 65001;
+        }else{
+            codepage = sniff_codepage(html, codepage);
+        }
+        if((codepage == 1200) || (codepage == 1201) || ((codepage >= 50220) && (codepage <= 50229))) {
+            _utf8.clear();
+            append_codepage(_utf8, codepage, html);
+            html = _utf8;
+            codepage = 65001;
+        }
+        _text = &text;
+        _codepage = codepage;
+        _run.clear();
+        _pre = 0;
+        _space = false;
+        _line = true;
+        const char *p = html.data();
+        const char *end = p + html.length();
+        while(p < end) {
+            char c = *p;
+            if(c == '<') {
+                if((end - p >= 4) && (!memcmp(p, "<!--", 4))) {
+                    const char *close = std::search(p + 4, end, "-->", "-->" + 3);
+                    p = close == end ? end : close + 3;
+                    continue;
+                }
+                const char *q = p + 1;
+                bool closing = (q < end) && (*q == '/');
+                if(closing) q++;
+                if((q < end) && ((*q == '!') || (*q == '?'))) {
+                    p = tag_end(q, end);
+                    continue;
+                }
+                char name[16];
+                size_t len = 0;
+                while((q < end) && (isalnum((unsigned char)*q))) {
+                    if(len < sizeof(name)) name[len] = (char)tolower((unsigned char)*q);
+                    len++;
+                    q++;
+                }
+                if(!len) {
+                    character(c);
+                    p++;
+                    continue;
+                }
+                std::string_view tag(name, std::min(len, sizeof(name)));
+                if(len > sizeof(name)) tag = std::string_view();
+                p = tag_end(q, end);
+                if((tag == "style") || (tag == "script") || (tag == "title")) {
+                    if(!closing) p = skip_element(p, end, tag);
+                }else if(tag == "br") {
+                    line(true);
+                }else if((tag == "td") || (tag == "th")) {
+                    if((!closing) && (!_line)) unicode('\t');
+                }else if(is_block(tag)) {
+                    line(false);
+                    if(tag == "pre") _pre = closing ? std::max(_pre - 1, 0) : _pre + 1;
+                }
+                continue;
+            }
+            if(c == '&') {
+                const char *semicolon = (const char *)memchr(p, ';', std::min((ptrdiff_t)32, end - p));
+                uint32_t value = semicolon ? entity(std::string_view(p + 1, semicolon - p - 1)) : 0;
+                if(value) {
+                    if(value != 0xAD) unicode(value);
+                    p = semicolon + 1;
+                    continue;
+                }
+            }
+            if((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == '\f')) {
+                if(!_pre) {
+                    _space = true;
+                }else if(c == '\n') {
+                    line(true);
+                }else if(c != '\r') {
+                    character(c);
+                }
+                p++;
+                continue;
+            }
+            character(c);
+            p++;
+        }
+        flush();
+        while((text.length()) && ((text.back() == '\n') || (text.back() == ' '))) text.pop_back();
+    }
+};
+
+/* the html body as text, through reusable buffers */
+static bool get_html_text(libpff_item_t *message, int codepage, Arena& arena, std::string_view& value) {
+    
+    static thread_local std::vector<uint8_t> data(BUFLEN);
+    static thread_local std::string text;
+    static thread_local HtmlText converter;
+    
+    ErrorHandle error;
+    size_t data_size = 0;
+    if((libpff_message_get_html_body_size(message, &data_size, &error) != 1) || (!data_size)) return false;
+    if(data.size() < data_size) data.resize(data_size);
+    if(libpff_message_get_html_body(message, data.data(), data_size, &error) != 1) return false;
+    size_t len = data_size;
+    while((len) && (!data[len - 1])) len--;
+    /* the last utf-16le character ends with a nul byte */
+    if((len & 1) && (len < data_size) && (data[0] == 0xFF) && (data[1] == 0xFE)) len++;
+    text.clear();
+    converter.convert(std::string_view((const char *)data.data(), len), codepage, text);
+    value = arena.copy(text.data(), text.length());
+    stats.bytes_decoded += value.length();
+    return true;
+}
+
+/*
+ * --attachments: data attachments are streamed to a file in fixed-size
+ * chunks and hashed on the way; embedded items and references are not files
+ */
+#define ATTACHMENT_CHUNK (BUFLEN*8)
+
+/* names come from the document; anything a file system may reject is replaced */
+static std::string attachment_file_name(std::string_view name) {
+    
+    std::string safe;
+    for (char c : name) {
+        safe += (((unsigned char)c < 0x20) || (strchr("/\\:*?\"<>|", c))) ? '_' : c;
+    }
+    if(safe.length() > 128) {
+        safe.erase(0, safe.length() - 128);
+        while ((safe.length()) && (((unsigned char)safe[0] & 0xc0) == 0x80)) safe.erase(0, 1);
+    }
+    return safe;
+}
+
+static void get_attachment_name(libpff_item_t *attachment, Arena& arena, std::string_view& name) {
+    
+    ErrorHandle error;
+    int num_record_sets = 0;
+    if(libpff_item_get_number_of_record_sets(attachment, &num_record_sets, &error) != 1) return;
+    for (int i = 0; i < num_record_sets; ++i) {
+        RecordSetHandle record_set;
+        if(libpff_item_get_record_set_by_index(attachment, i, &record_set, &error) != 1) continue;
+        int num_entries = 0;
+        if(libpff_record_set_get_number_of_entries(record_set, &num_entries, &error) != 1) continue;
+        for (int j = 0; j < num_entries; ++j) {
+            RecordEntryHandle record_entry;
+            if(libpff_record_set_get_entry_by_index(record_set, j, &record_entry, &error) != 1) continue;
+            uint32_t entry_type = 0;
+            if(libpff_record_entry_get_entry_type(record_entry, &entry_type, &error) != 1) continue;
+            /* the long name wins over the 8.3 one */
+            if((entry_type == LIBPFF_ENTRY_TYPE_ATTACHMENT_FILENAME_LONG)
+               || ((entry_type == LIBPFF_ENTRY_TYPE_ATTACHMENT_FILENAME_SHORT) && (!name.length()))) {
+                std::string_view value;
+                if((get_entry_string(attachment, record_entry, entry_type, &arena, value)) && (value.length())) {
+                    name = value;
+                    if(entry_type == LIBPFF_ENTRY_TYPE_ATTACHMENT_FILENAME_LONG) return;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * --attachment-store: blobs are named by their sha256 under two levels of
+ * directories; the index of the blobs written so far is kept in the store,
+ * so that a blob seen by an earlier run is only hashed
+ */
+class AttachmentStore {
+    std::filesystem::path _dir;
+    std::mutex _mutex;
+    std::unordered_set<std::string> _blobs;
+    std::vector<std::string> _added;
+public:
+    AttachmentStore(const std::filesystem::path& dir) : _dir(dir) {}
+    std::filesystem::path path(const uint8_t digest[32]) const {
+        std::string name = digest_to_string(digest);
+        return _dir / name.substr(0, 2) / name.substr(2, 2) / name;
+    }
+    /* true if the caller is to write the blob; a blob is written by one worker only */
+    bool claim(const uint8_t digest[32]) {
+        std::string key((const char *)digest, 32);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_blobs.insert(key).second) return false;
+        _added.push_back(key);
+        std::error_code ec;
+        return !std::filesystem::exists(path(digest), ec);
+    }
+    void release(const uint8_t digest[32]) {
+        std::string key((const char *)digest, 32);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _blobs.erase(key);
+        _added.erase(std::remove(_added.begin(), _added.end(), key), _added.end());
+    }
+    /* the index is a plain array of 32 byte digests */
+    void load() {
+        FILE *f = _fopen((_dir / "index").c_str(), _rb);
+        if(!f) return;
+        char digest[32];
+        while (fread(digest, sizeof(digest), 1, f) == 1) {
+            _blobs.insert(std::string(digest, sizeof(digest)));
+        }
+        fclose(f);
+    }
+    void save() {
+        if(!_added.size()) return;
+        FILE *f = _fopen((_dir / "index").c_str(), _ab);
+        if(!f) {
+            std::cerr << "Failed to open attachment index!" << std::endl;
+            return;
+        }
+        for (const auto &digest : _added) {
+            fwrite(digest.data(), 1, digest.length(), f);
+        }
+        fclose(f);
+        _added.clear();
+    }
+};
+
+/* copies the attachment data from the current offset to f and/or sha256 */
+static bool stream_attachment(libpff_item_t *attachment, Sha256 *sha256, FILE *f, uint64_t& size) {
+    
+    static thread_local std::vector<uint8_t> buf(ATTACHMENT_CHUNK);
+    
+    ErrorHandle error;
+    size = 0;
+    for (;;) {
+        ssize_t len = libpff_attachment_data_read_buffer(attachment, buf.data(), buf.size(), &error);
+        if(len <= 0) return len == 0;
+        if(sha256) sha256->update(buf.data(), (size_t)len);
+        size += (uint64_t)len;
+        if((f) && (fwrite(buf.data(), 1, (size_t)len, f) != (size_t)len)) return false;
+    }
+}
+
+/* hashed first; the data is read a second time only for a blob the store does not have */
+static bool store_attachment(AttachmentStore& store, libpff_item_t *attachment, Attachment& entry, std::filesystem::path& path) {
+    
+    ErrorHandle error;
+    Sha256 sha256;
+    if(!stream_attachment(attachment, &sha256, NULL, entry.size)) return false;
+    sha256.final(entry.sha256);
+    path = store.path(entry.sha256);
+    if(!store.claim(entry.sha256)) return true;
+    
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    std::filesystem::path temp = path;
+    temp += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    bool ok = false;
+    uint64_t size = 0;
+    FILE *f = NULL;
+    if((libpff_attachment_data_seek_offset(attachment, 0, SEEK_SET, &error) == 0)
+       && ((f = _fopen(temp.c_str(), _wb)) != NULL)) {
+        ok = stream_attachment(attachment, NULL, f, size) && (size == entry.size);
+        ok = (fclose(f) == 0) && ok;
+        if(ok) std::filesystem::rename(temp, path, ec);
+        ok = ok && !ec;
+    }
+    if(!ok) {
+        std::filesystem::remove(temp, ec);
+        store.release(entry.sha256);
+    }
+    return ok;
+}
+
+static void read_message(const Context& context, libpff_item_t *sub_message, Arena& arena, Message& message, int depth = 0, uint32_t id = 0, const std::string& chain = "");
+
+/*
+ * --embedded: an attached message is read like any other message, into
+ * the arena of its parent and within its -j chunk, not as a task of its own;
+ * id and chain are those of the top-level message and the attachment
+ * indices down to this one, as the identifier of an attached item is only
+ * unique within its parent
+ */
+static void read_attachments(const Context& context, libpff_item_t *sub_message, Arena& arena, Message& message, int depth, uint32_t id, const std::string& chain) {
+    
+    ErrorHandle error;
+    int num_attachments = 0;
+    if((libpff_message_get_number_of_attachments(sub_message, &num_attachments, &error) != 1) || (!num_attachments)) return;
+    if(!depth) {
+        id = message.id;
+        if(!id) libpff_item_get_identifier(sub_message, &id, &error);
+    }
+    for (int i = 0; i < num_attachments; ++i) {
+        ItemHandle attachment;
+        int type = 0;
+        if((libpff_message_get_attachment(sub_message, i, &attachment, &error) != 1)
+           || (libpff_attachment_get_type(attachment, &type, &error) != 1)) continue;
+        if(type == LIBPFF_ATTACHMENT_TYPE_ITEM) {
+            ItemHandle item;
+            if((depth < context.embedded) && (libpff_attachment_get_item(attachment, &item, &error) == 1)) {
+                message.embedded.push_back(Message());
+                message.embedded.back().index = i;
+                read_message(context, item, arena, message.embedded.back(), depth + 1, id, chain + std::to_string(i) + ".");
+            }
+            continue;
+        }
+        if((type != LIBPFF_ATTACHMENT_TYPE_DATA) || (!context.attachments)) continue;
+        Attachment entry;
+        get_attachment_name(attachment, arena, entry.name);
+        std::filesystem::path path;
+        if(context.store) {
+            if(!store_attachment(*context.store, attachment, entry, path)) {
+                std::cerr << "Failed to store attachment!" << std::endl;
+                continue;
+            }
+        }else{
+            /* the message identifier and attachment indices keep names unique and the same with -j */
+            path = *context.attachments / utf8_to_path(std::to_string(id) + "_" + chain + std::to_string(i) + "_" + attachment_file_name(entry.name));
+            FILE *f = _fopen(path.c_str(), _wb);
+            if(!f) {
+                std::cerr << "Failed to open attachment file!" << std::endl;
+                continue;
+            }
+            Sha256 sha256;
+            bool ok = stream_attachment(attachment, &sha256, f, entry.size);
+            ok = (fclose(f) == 0) && ok;
+            if(!ok) {
+                std::cerr << "Failed to write attachment file!" << std::endl;
+                std::error_code ec;
+                std::filesystem::remove(path, ec);
+                continue;
+            }
+            sha256.final(entry.sha256);
+        }
+        std::string file = path_to_utf8(path);
+        entry.file = arena.copy(file.c_str(), file.length());
+        message.attachments.push_back(entry);
+    }
+}
+
+static void read_message(const Context& context, libpff_item_t *sub_message, Arena& arena, Message& message, int depth, uint32_t id, const std::string& chain) {
+    
+    stats.messages++;
+    ErrorHandle error;
+    std::string_view value;
+    if((context.manifest) && (!depth)) {
+        if((libpff_item_get_identifier(sub_message, &message.id, &error) == 1)
+           && (libpff_message_get_modification_time(sub_message, &message.modified, &error) == 1)
+           && (context.manifest->unchanged(message.id, message.modified, message.content))) {
+            message.status = Message::UNCHANGED;
+            return;
+        }
+    }
+    /* the dedup hash needs its fields whether they are written or not */
+    unsigned int fields = context.fields | (context.dedup ? DEDUP_FIELDS : 0);
+    /* text is decoded after the scan, from the first body of --body-preference the message has */
+    struct {
+        int record_set = -1;
+        int record_entry = -1;
+    } bodies[3];
+    uint32_t codepage = 0;
+    /* the submit time stands in for a missing delivery time */
+    uint64_t submit_time = 0;
+    int num_record_sets = 0;
+    if(libpff_item_get_number_of_record_sets(sub_message, &num_record_sets, &error) == 1){
+        for (int i = 0; i < num_record_sets; ++i) {
+            RecordSetHandle record_set;
+            if(libpff_item_get_record_set_by_index(sub_message, i, &record_set, &error) != 1) continue;
+            int num_entries = 0;
+            if(libpff_record_set_get_number_of_entries(record_set, &num_entries, &error) == 1){
+                for (int j = 0; j < num_entries; ++j) {
+                    RecordEntryHandle record_entry;
+                    if(libpff_record_set_get_entry_by_index(record_set, j, &record_entry, &error) != 1) continue;
+                    uint32_t entry_type = 0;
+                    if(libpff_record_entry_get_entry_type(record_entry, &entry_type, &error) != 1) continue;
+                    if(fields & FIELD_TEXT) {
+                        auto body = std::find(context.body->begin(), context.body->end(), entry_type);
+                        if((body != context.body->end()) && (bodies[body - context.body->begin()].record_set < 0)) {
+                            bodies[body - context.body->begin()] = {i, j};
+                        }
+                    }
+                    if(entry_type_field(entry_type) & fields){
+                        Timer timer(stats.decode_ns[field_index(entry_type_field(entry_type))]);
+                        switch (entry_type) {
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_SUBJECT:
+                                get_entry_string(sub_message, record_entry, entry_type, &arena, message.subject, '\1');
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_NAME:
+                                if(get_entry_string(sub_message, record_entry, entry_type, NULL, value)) {
+                                    message.sender.name = context.pool->intern(value);
+                                }
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_EMAIL_ADDRESS:
+                                if(get_entry_string(sub_message, record_entry, entry_type, NULL, value)) {
+                                    message.sender.address = context.pool->intern(value);
+                                }
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_NAME:
+                                if(get_entry_string(sub_message, record_entry, entry_type, NULL, value)) {
+                                    message.recipient.name = context.pool->intern(value);
+                                }
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_EMAIL_ADDRESS:
+                                if(get_entry_string(sub_message, record_entry, entry_type, NULL, value)) {
+                                    message.recipient.address = context.pool->intern(value);
+                                }
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_BODY_CODEPAGE:
+                                libpff_record_entry_get_data_as_32bit_integer(record_entry, &codepage, &error);
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_BODY_HTML:
+                                get_entry_binary(sub_message, record_entry, entry_type, arena, message.html);
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_CLIENT_SUBMIT_TIME:
+                                libpff_record_entry_get_data_as_filetime(record_entry, &submit_time, &error);
+                                break;
+                            case LIBPFF_ENTRY_TYPE_MESSAGE_DELIVERY_TIME:
+                                libpff_record_entry_get_data_as_filetime(record_entry, &message.time, &error);
+                                break;
+                            default:
+                                break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if(!message.time) message.time = submit_time;
+    for (size_t i = 0; i < context.body->size(); ++i) {
+        if(bodies[i].record_set < 0) continue;
+        Timer timer(stats.decode_ns[field_index(FIELD_TEXT)]);
+        uint32_t entry_type = (*context.body)[i];
+        if(entry_type == LIBPFF_ENTRY_TYPE_MESSAGE_BODY_HTML) {
+            get_html_text(sub_message, (int)codepage, arena, message.text);
+        }else{
+            RecordSetHandle record_set;
+            RecordEntryHandle record_entry;
+            if((libpff_item_get_record_set_by_index(sub_message, bodies[i].record_set, &record_set, &error) != 1)
+               || (libpff_record_set_get_entry_by_index(record_set, bodies[i].record_entry, &record_entry, &error) != 1)) continue;
+            if(entry_type == LIBPFF_ENTRY_TYPE_MESSAGE_BODY_PLAIN_TEXT) {
+                get_entry_string(sub_message, record_entry, entry_type, &arena, message.text);
+            }else{
+                get_entry_rtf(record_entry, arena, message.text);
+            }
+        }
+        if(message.text.length()) break;
+    }
+    if(context.dedup) {
+        message.hash = message_hash(message, *context.pool);
+    }
+    if((context.attachments) || (context.embedded)) {
+        read_attachments(context, sub_message, arena, message, depth, id, chain);
+    }
+    if((context.manifest) && (!depth)) {
+        message.content = content_hash(message, context.fields, *context.pool);
+        if(message.id) message.status = context.manifest->status(message.id, message.content);
+    }
+}
+
+static bool get_folder_name(libpff_item_t *folder, std::string& name) {
+    
+    static thread_local std::vector<uint8_t> buf(BUFLEN);
+    
+    ErrorHandle error;
+    size_t utf8_string_size = 0;
+    if(libpff_folder_get_utf8_name_size(folder, &utf8_string_size, &error) == 1){
+        if(buf.size() < utf8_string_size + 1) buf.resize(utf8_string_size + 1);
+        if(libpff_folder_get_utf8_name(folder, buf.data(), buf.size(), &error) == 1){
+            name = (const char *)buf.data();
+            stats.folders++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * --resume: resume is passed down while the folder is on the checkpoint path;
+ * folders before the path were written, and so were the subfolders of the
+ * checkpoint folder, whose messages come after them
+ */
+static void resume_folder(const Resume *resume, size_t depth, int num_subfolders, int& first_folder, int& first_message) {
+    
+    first_folder = 0;
+    first_message = 0;
+    if(resume) {
+        if(depth < resume->folders.size()) {
+            first_folder = resume->folders[depth];
+        }else{
+            first_folder = num_subfolders;
+            first_message = resume->message;
+        }
+    }
+}
+
+static const Resume *resume_sub_folder(const Resume *resume, size_t depth, int index) {
+    
+    if((resume) && (depth < resume->folders.size()) && (resume->folders[depth] == index)) {
+        return resume;
+    }
+    return NULL;
+}
+
+/*
+ * --folder: globs on the folder names from the root, separated by /;
+ * * and ? stay within a name and ** spans any number of folders;
+ * a pattern that does not start with / may match at any depth;
+ * a folder that matches an exclude (!) pattern is skipped with its subfolders,
+ * and with include patterns only the messages of matching folders are read,
+ * while subfolders are only opened if an include could match below them
+ */
+class FolderFilter {
+    struct Pattern {
+        std::vector<std::string> parts;
+        bool exclude;
+    };
+    std::vector<Pattern> _patterns;
+    bool _includes;
+    static bool match_name(const char *pattern, const char *name) {
+        for (; *pattern; ++pattern, ++name) {
+            if(*pattern == '*') {
+                for (const char *rest = name; ; ++rest) {
+                    if(match_name(pattern + 1, rest)) return true;
+                    if(!*rest) return false;
+                }
+            }
+            if((!*name) || ((*pattern != '?') && (*pattern != *name))) return false;
+        }
+        return !*name;
+    }
+    /* with prefix, a path that ends before the pattern does may still have a match below it */
+    static bool match(const std::vector<std::string>& parts, size_t i,
+                      const std::vector<std::string>& names, size_t j, bool prefix) {
+        if(i == parts.size()) return j == names.size();
+        if(parts[i] == "**") {
+            return match(parts, i + 1, names, j, prefix) || ((j < names.size()) && (match(parts, i, names, j + 1, prefix)));
+        }
+        if(j == names.size()) return prefix;
+        return match_name(parts[i].c_str(), names[j].c_str()) && match(parts, i + 1, names, j + 1, prefix);
+    }
+public:
+    FolderFilter() : _includes(false) {}
+    bool empty() const {
+        return !_patterns.size();
+    }
+    void add(const std::string& glob) {
+        Pattern pattern;
+        size_t start = 0;
+        pattern.exclude = (glob.length()) && (glob[0] == '!');
+        if(pattern.exclude) start++;
+        if((start < glob.length()) && (glob[start] == '/')) {
+            start++;
+        }else{
+            pattern.parts.push_back("**");
+        }
+        while (start <= glob.length()) {
+            size_t end = glob.find('/', start);
+            if(end == std::string::npos) end = glob.length();
+            if(end > start) pattern.parts.push_back(glob.substr(start, end - start));
+            start = end + 1;
+        }
+        if(!pattern.exclude) _includes = true;
+        _patterns.push_back(std::move(pattern));
+    }
+    /* whether the folder is opened at all */
+    bool visit(const std::vector<std::string>& names) const {
+        bool below = !_includes;
+        for (const auto &pattern : _patterns) {
+            if(pattern.exclude) {
+                if(match(pattern.parts, 0, names, 0, false)) return false;
+            }else if(!below) {
+                below = match(pattern.parts, 0, names, 0, true);
+            }
+        }
+        return below;
+    }
+    /* whether the messages of a visited folder are read */
+    bool read(const std::vector<std::string>& names) const {
+        if(!_includes) return true;
+        for (const auto &pattern : _patterns) {
+            if((!pattern.exclude) && (match(pattern.parts, 0, names, 0, false))) return true;
+        }
+        return false;
+    }
+};
+
+/* names is the path of the folder from the root; its length is the depth of the folder */
+static void process_folder(Writer& writer,
+                           const Context& context,
+                           libpff_file_t *file,
+                           libpff_item_t *folder,
+                           std::vector<std::string>& names,
+                           const Resume *resume) {
+    
+    ErrorHandle error;
+    int num_messages = 0;
+    int num_subfolders = 0;
+    if(libpff_folder_get_number_of_sub_messages(folder, &num_messages, &error) == 1){
+        if(libpff_folder_get_number_of_sub_folders(folder, &num_subfolders, &error) == 1){
+            
+            int first_folder, first_message;
+            size_t depth = names.size();
+            resume_folder(resume, depth, num_subfolders, first_folder, first_message);
+            for (int i = first_folder; i < num_subfolders; ++i) {
+                ItemHandle sub_folder;
+                if(libpff_folder_get_sub_folder(folder, i, &sub_folder, &error) == 1){
+                    std::string name;
+                    if(get_folder_name(sub_folder, name)){
+                        names.push_back(name);
+                        if((!context.filter) || (context.filter->visit(names))) {
+                            writer.begin_folder(name, i);
+                            process_folder(writer, context, file, sub_folder, names, resume_sub_folder(resume, depth, i));
+                            writer.end_folder();
+                        }
+                        names.pop_back();
+                    }
+                }
+            }
+            if((context.filter) && (!context.filter->read(names))) {
+                num_messages = 0;
+            }
+            for (int i = first_message; i < num_messages; ++i) {
+                ItemHandle sub_message;
+                if(libpff_folder_get_sub_message(folder, i, &sub_message, &error) == 1){
+                    Message message;
+                    message.index = i;
+                    read_message(context, sub_message, writer.arena(), message);
+                    writer.message(std::move(message));
+                }
+            }
+        }
+    }
+}
+static void process_root_folder(Writer& writer,
+                           const Context& context,
+                           libpff_file_t *file,
+                           libpff_item_t *folder) {
+    
+    ErrorHandle error;
+    int num_subfolders = 0;
+    if(libpff_folder_get_number_of_sub_folders(folder, &num_subfolders, &error) == 1){
+        int first_folder, first_message;
+        std::vector<std::string> names;
+        resume_folder(context.resume, 0, num_subfolders, first_folder, first_message);
+        for (int i = first_folder; i < num_subfolders; ++i) {
+            ItemHandle sub_folder;
+            if(libpff_folder_get_sub_folder(folder, i, &sub_folder, &error) == 1){
+                std::string name;
+                if(get_folder_name(sub_folder, name)){
+                    names.push_back(name);
+                    if((!context.filter) || (context.filter->visit(names))) {
+                        writer.begin_folder(name, i);
+                        process_folder(writer, context, file, sub_folder, names, resume_sub_folder(context.resume, 0, i));
+                        writer.end_folder();
+                    }
+                    names.pop_back();
+                }
+            }
+        }
+    }
+}
+
+/*
+ * --ids: point lookups instead of the folder walk; the messages are
+ * written in the order given, in one folder named IDS_FOLDER
+ */
+#define IDS_FOLDER "ids"
+
+static bool get_message_by_identifier(libpff_file_t *file, uint32_t id, ItemHandle& item) {
+    
+    ErrorHandle error;
+    uint8_t type = 0;
+    if((libpff_file_get_item_by_identifier(file, id, &item, &error) == 1)
+       && (libpff_item_get_type(item, &type, &error) == 1)
+       && (type != LIBPFF_ITEM_TYPE_FOLDER)) {
+        return true;
+    }
+    item.reset();
+    std::cerr << "No message with identifier " << id << "!" << std::endl;
+    return false;
+}
+
+static void process_ids(Writer& writer,
+                        const Context& context,
+                        libpff_file_t *file) {
+    
+    const std::vector<uint32_t>& ids = *context.ids;
+    writer.begin_folder(IDS_FOLDER, 0);
+    for (size_t i = context.resume ? context.resume->message : 0; i < ids.size(); ++i) {
+        ItemHandle sub_message;
+        if(get_message_by_identifier(file, ids[i], sub_message)){
+            Message message;
+            message.index = (int)i;
+            message.id = ids[i];
+            read_message(context, sub_message, writer.arena(), message);
+            writer.message(std::move(message));
+        }
+    }
+    writer.end_folder();
+}
+
+/*
+ * parallel extraction: the folder tree is planned on the calling thread,
+ * messages are read in chunks by workers that each own a libpff_file_t,
+ * and the writer consumes the chunks in folder order;
+ * with --max-memory a worker waits while the messages not yet written
+ * exceed the budget, except on the chunk the writer is waiting for
+ */
+#define MESSAGES_PER_TASK 32
+
+struct Task {
+    /* IDS are messages by position in context.ids */
+    enum Type { BEGIN_FOLDER, MESSAGES, IDS, END_FOLDER } type;
+    std::string name;
+    std::vector<int> path;
+    int begin;
+    int end;
+    bool done;
+    std::vector<Message> messages;
+    Arena arena;
+    Task(Type type, const std::string& name, const std::vector<int>& path, int begin, int end, bool done)
+    : type(type), name(name), path(path), begin(begin), end(end), done(done) {}
+};
+
+static void plan_folder(std::vector<Task>& tasks,
+                        std::vector<int>& path,
+                        std::vector<std::string>& names,
+                        libpff_item_t *folder,
+                        const Context& context,
+                        const Resume *resume) {
+    
+    ErrorHandle error;
+    int num_messages = 0;
+    int num_subfolders = 0;
+    if(libpff_folder_get_number_of_sub_messages(folder, &num_messages, &error) == 1){
+        if(libpff_folder_get_number_of_sub_folders(folder, &num_subfolders, &error) == 1){
+            
+            int first_folder, first_message;
+            resume_folder(resume, path.size(), num_subfolders, first_folder, first_message);
+            for (int i = first_folder; i < num_subfolders; ++i) {
+                ItemHandle sub_folder;
+                if(libpff_folder_get_sub_folder(folder, i, &sub_folder, &error) == 1){
+                    std::string name;
+                    if(get_folder_name(sub_folder, name)){
+                        names.push_back(name);
+                        if((!context.filter) || (context.filter->visit(names))) {
+                            const Resume *sub_resume = resume_sub_folder(resume, path.size(), i);
+                            path.push_back(i);
+                            tasks.push_back({Task::BEGIN_FOLDER, name, path, 0, 0, true});
+                            plan_folder(tasks, path, names, sub_folder, context, sub_resume);
+                            tasks.push_back({Task::END_FOLDER, name, path, 0, 0, true});
+                            path.pop_back();
+                        }
+                        names.pop_back();
+                    }
+                }
+            }
+            if((context.filter) && (!context.filter->read(names))) {
+                num_messages = 0;
+            }
+            for (int i = first_message; i < num_messages; i += MESSAGES_PER_TASK) {
+                tasks.push_back({Task::MESSAGES, "", path, i, std::min(i + MESSAGES_PER_TASK, num_messages), false});
+            }
+        }
+    }
+}
+
+static ItemHandle find_folder(libpff_file_t *file, const std::vector<int>& path) {
+    
+    ErrorHandle error;
+    ItemHandle folder;
+    if (libpff_file_get_root_folder(file, &folder, &error) == 1) {
+        for (int i : path) {
+            ItemHandle sub_folder;
+            if(libpff_folder_get_sub_folder(folder, i, &sub_folder, &error) != 1) {
+                return ItemHandle();
+            }
+            folder = std::move(sub_folder);
+        }
+    }
+    return folder;
+}
+
+static void run_tasks(Writer& writer,
+                      const Context& context,
+                      libpff_file_t *file,
+                      std::vector<Task>& tasks) {
+    
+    std::vector<size_t> queue;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if((tasks[i].type == Task::MESSAGES) || (tasks[i].type == Task::IDS)) queue.push_back(i);
+    }
+    
+    std::mutex mutex;
+    std::condition_variable done;
+    std::atomic<size_t> next(0);
+    int workers = context.jobs;
+    size_t in_flight = 0;
+    size_t head = 0;
+    
+    auto work = [&](libpff_file_t *worker_file) {
+        ErrorHandle error;
+        ItemHandle folder;
+        const std::vector<int> *folder_path = NULL;
+        for (size_t i = next++; i < queue.size(); i = next++) {
+            Task& task = tasks[queue[i]];
+            bool by_id = task.type == Task::IDS;
+            if((!by_id) && ((!folder_path) || (*folder_path != task.path))) {
+                folder = find_folder(worker_file, task.path);
+                folder_path = &task.path;
+            }
+            if((folder) || (by_id)) {
+                for (int j = task.begin; j < task.end; ++j) {
+                    if(context.max_memory) {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        done.wait(lock, [&]() { return in_flight < context.max_memory || queue[i] == head; });
+                    }
+                    ItemHandle sub_message;
+                    if(by_id ? get_message_by_identifier(worker_file, (*context.ids)[j], sub_message)
+                       : (libpff_folder_get_sub_message(folder, j, &sub_message, &error) == 1)){
+                        task.messages.push_back(Message());
+                        task.messages.back().index = j;
+                        if(by_id) task.messages.back().id = (*context.ids)[j];
+                        read_message(context, sub_message, task.arena, task.messages.back());
+                        if(context.max_memory) {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            in_flight += message_size(task.messages.back());
+                        }
+                    }
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            task.done = true;
+            done.notify_all();
+        }
+    };
+    
+    auto run = [&](libpff_file_t *worker_file) {
+        if(worker_file) {
+            work(worker_file);
+        }else{
+            ErrorHandle error;
+            Input input;
+            FileHandle own_file;
+            if (libpff_file_initialize(&own_file, &error) == 1) {
+                if (open_input(context, input, own_file, &error) == 1) {
+                    work(own_file);
+                    libpff_file_close(own_file, &error);
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        workers--;
+        done.notify_all();
+    };
+    
+    std::vector<std::thread> threads;
+    threads.emplace_back(run, file);
+    for (int i = 1; i < context.jobs; ++i) {
+        threads.emplace_back(run, (libpff_file_t *)NULL);
+    }
+    
+    for (auto &task : tasks) {
+        switch (task.type) {
+            case Task::BEGIN_FOLDER:
+                writer.begin_folder(task.name, task.path.back());
+                break;
+            case Task::END_FOLDER:
+                writer.end_folder();
+                break;
+            case Task::MESSAGES:
+            case Task::IDS:
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                head = &task - tasks.data();
+                done.notify_all();
+                done.wait(lock, [&]() { return task.done || workers == 0; });
+            }
+                for (auto &message : task.messages) {
+                    size_t size = context.max_memory ? message_size(message) : 0;
+                    writer.message(std::move(message));
+                    if(size) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        in_flight -= size;
+                        done.notify_all();
+                    }
+                }
+                std::vector<Message>().swap(task.messages);
+                writer.adopt(std::move(task.arena));
+                break;
+        }
+    }
+    
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+static void process_root_folder_parallel(Writer& writer,
+                                         const Context& context,
+                                         libpff_file_t *file,
+                                         libpff_item_t *root_folder) {
+    
+    std::vector<Task> tasks;
+    std::vector<int> path;
+    std::vector<std::string> names;
+    plan_folder(tasks, path, names, root_folder, context, context.resume);
+    run_tasks(writer, context, file, tasks);
+}
 
-struct Document {
-    std::string type;
-    std::vector<Folder> folders;
-};
+static void process_ids_parallel(Writer& writer,
+                                 const Context& context,
+                                 libpff_file_t *file) {
+    
+    std::vector<Task> tasks;
+    std::vector<int> path(1, 0);
+    int num_ids = (int)context.ids->size();
+    tasks.push_back({Task::BEGIN_FOLDER, IDS_FOLDER, path, 0, 0, true});
+    for (int i = context.resume ? context.resume->message : 0; i < num_ids; i += MESSAGES_PER_TASK) {
+        tasks.push_back({Task::IDS, "", path, i, std::min(i + MESSAGES_PER_TASK, num_ids), false});
+    }
+    tasks.push_back({Task::END_FOLDER, IDS_FOLDER, path, 0, 0, true});
+    run_tasks(writer, context, file, tasks);
+}
 
-#if defined(_WIN32)
-static int create_temp_file_path(std::wstring& path) {
-    std::vector<wchar_t>buf(1024);
-    if (GetTempPathW((DWORD)buf.size(), buf.data()) == 0) return -1;
-    if (GetTempFileNameW(buf.data(), L"pff", 0, buf.data()) == 0) return -1;
-    path = std::wstring(buf.data());
-    return 0;
+static void extract(Writer& writer,
+                    const Context& context,
+                    libpff_file_t *file,
+                    libpff_item_t *root_folder) {
+    
+    Timer timer(stats.traversal_ns);
+    Writer *target = &writer;
+    /* duplicates are decided in output order, so -j does not change which copy is kept */
+    std::unique_ptr<DedupWriter> dedup_writer;
+    if(context.dedup) {
+        dedup_writer.reset(new DedupWriter(*target, *context.dedup));
+        target = dedup_writer.get();
+    }
+    std::unique_ptr<ManifestWriter> manifest_writer;
+    if(context.manifest) {
+        manifest_writer.reset(new ManifestWriter(*target, *context.manifest));
+        target = manifest_writer.get();
+    }
+    if(context.ids) {
+        if(context.jobs > 1) {
+            process_ids_parallel(*target, context, file);
+        }else{
+            process_ids(*target, context, file);
+        }
+    }else if(context.jobs > 1) {
+        process_root_folder_parallel(*target, context, file, root_folder);
+    }else{
+        process_root_folder(*target, context, file, root_folder);
+    }
+    if(context.manifest) {
+        for (uint32_t id : context.manifest->removed()) {
+            writer.removed(id);
+        }
+    }
 }
-#else
-static int create_temp_file_path(std::string& path) {
-    const char *tmpdir = getenv("TMPDIR");
-    if (!tmpdir) tmpdir = "/tmp";
-    std::vector<char>buf(1024);
-    snprintf(buf.data(), buf.size(), "pff%sXXXXXX", tmpdir);
-    path = std::string(buf.data());
-    int fd = mkstemp((char *)path.c_str());
-    if (fd == -1) return -1;
-    close(fd);
-    return 0;
+
+static bool open_document(const Context& context,
+                          Input& input,
+                          FileHandle& file,
+                          ItemHandle& root_folder,
+                          std::string& type) {
+    
+    ErrorHandle error;
+    Timer timer(stats.open_ns);
+    if (libpff_file_initialize(&file, &error) == 1) {
+        if (open_input(context, input, file, &error) == 1) {
+            uint8_t content_type = 0;
+            if(libpff_file_get_content_type(file, &content_type, &error) == 1){
+                switch (content_type) {
+                    case LIBPFF_FILE_CONTENT_TYPE_PST:
+                        type = "pst";
+                        break;
+                    case LIBPFF_FILE_CONTENT_TYPE_PAB:
+                        type = "pab";
+                        break;
+                    case LIBPFF_FILE_CONTENT_TYPE_OST:
+                        type = "ost";
+                        break;
+                }
+                if (libpff_file_get_root_folder(file, &root_folder, &error) == 1) {
+                    return true;
+                }else{
+                    std::cerr << "Failed to get PFF root item!" << std::endl;
+                }
+            }else{
+                std::cerr << "Unknown file content type!" << std::endl;
+            }
+        }else{
+            std::cerr << "Failed to load PFF file!" << std::endl;
+        }
+    }
+    return false;
 }
-#endif
 
-static void __(Folder& folder, Json::Value& folders){
+/* how streamed output is written; the json tree is used when no option asks for streaming */
+struct Output {
+    bool raw;
+    bool ndjson;
+    std::string field_delimiter;
+    std::string record_delimiter;
+};
 
-    Json::Value folderNode(Json::objectValue);
-    folderNode["name"] = folder.name;
+static void write_document(Sink& sink,
+                           const Output& output,
+                           const Context& context,
+                           libpff_file_t *file,
+                           libpff_item_t *root_folder,
+                           const std::string& type) {
     
-    Json::Value messagesNode(Json::arrayValue);
-    for (const auto &message : folder.messages) {
-        Json::Value senderNode(Json::objectValue);
-        senderNode["name"] = message.sender.name;
-        senderNode["address"] = message.sender.address;
-        Json::Value recipientNode(Json::objectValue);
-        recipientNode["name"] = message.recipient.name;
-        recipientNode["address"] = message.recipient.address;
-        
-        Json::Value messageNode(Json::objectValue);
-        messageNode["subject"] = message.subject;
-        messageNode["text"] = message.text;
-        messageNode["sender"] = senderNode;
-//        messageNode["recipient"] = recipientNode;
-        messagesNode.append(messageNode);
+    std::unique_ptr<Writer> writer;
+    if(output.raw) {
+        writer.reset(new RawWriter(sink, context, output.field_delimiter, output.record_delimiter));
+    }else if(output.ndjson) {
+        writer.reset(new NdjsonWriter(sink, context));
+    }else{
+        writer.reset(new JsonWriter(sink, type, context));
+    }
+    if(context.checkpoint) {
+        CheckpointWriter checkpoint_writer(*writer, sink, context.checkpoint);
+        extract(checkpoint_writer, context, file, root_folder);
+    }else{
+        extract(*writer, context, file, root_folder);
     }
-    folderNode["messages"] = messagesNode;
+}
+
+/*
+ * batch mode: documents are read by a pool of workers, largest first,
+ * each by a single thread; output is one file per document in
+ * --output-dir, or else one ndjson stream with a "file" key per line
+ */
+static bool is_document_path(const std::filesystem::path& path) {
     
-    Json::Value foldersNode(Json::arrayValue);
-    for (auto &_folder : folder.folders) {
-        __(_folder, foldersNode);
+    std::string extension = path_to_utf8(path.extension());
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+    return (extension == ".pst") || (extension == ".ost") || (extension == ".pab");
+}
+
+static void read_input_list(std::vector<std::filesystem::path>& inputs, const OPTARG_T list_path) {
+    
+    std::ifstream list{std::filesystem::path(list_path)};
+    if(!list) {
+        std::cerr << "Failed to open input list!" << std::endl;
+        return;
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        if((line.length()) && (line.back() == '\r')) line.pop_back();
+        if(line.length()) inputs.push_back(utf8_to_path(line));
     }
-    folderNode["folders"] = foldersNode;
-    folders.append(folderNode);
 }
 
-static void _(Folder& folder, std::string& text){
+static void read_input_dir(std::vector<std::filesystem::path>& inputs, const OPTARG_T dir_path) {
     
-    for (const auto &message : folder.messages) {
-        text += message.sender.name;
-        text += message.sender.address;
-//        text += message.recipient.name;
-//        text += message.recipient.address;
-        text += message.subject;
-        text += message.text;
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it(dir_path, std::filesystem::directory_options::skip_permission_denied, ec);
+    if(ec) {
+        std::cerr << "Failed to open input directory!" << std::endl;
+        return;
     }
-    for (auto &_folder : folder.folders) {
-        _(_folder, text);
+    for (std::filesystem::recursive_directory_iterator end; it != end; it.increment(ec)) {
+        if(ec) break;
+        if((it->is_regular_file(ec)) && (is_document_path(it->path()))) {
+            inputs.push_back(it->path());
+        }
     }
 }
 
-static void document_to_json(Document& document, std::string& text, bool rawText) {
+/*
+ * batch outputs mirror the inputs below the directory they have in common,
+ * so that a/archive.pst and b/archive.pst do not write the same file
+ */
+static std::filesystem::path batch_root(const std::vector<std::filesystem::path>& inputs) {
     
-    if(rawText){
-        text = "";
-        for (auto &folder : document.folders) {
-            _(folder, text);
+    std::filesystem::path root;
+    bool first = true;
+    for (const auto &input : inputs) {
+        std::filesystem::path parent = input.parent_path();
+        if(first) {
+            root = parent;
+            first = false;
+            continue;
         }
-    }else{
-        Json::Value documentNode(Json::objectValue);
-        documentNode["type"] = document.type;
-                
-        Json::Value foldersNode(Json::arrayValue);
-        for (auto &folder : document.folders) {
-            __(folder, foldersNode);
+        std::filesystem::path common;
+        auto a = root.begin();
+        auto b = parent.begin();
+        for (; (a != root.end()) && (b != parent.end()) && (*a == *b); ++a, ++b) {
+            common /= *a;
         }
-        documentNode["folders"] = foldersNode;
-        
-        Json::StreamWriterBuilder writer;
-        writer["indentation"] = "";
-        text = Json::writeString(writer, documentNode);
+        root = common;
     }
+    return root;
 }
 
-static void process_folder(Folder& document,
-                           libpff_file_t *file,
-                           libpff_item_t *folder) {
+/* an open document, its caches and the message being decoded; bounds the batch pool with --max-memory */
+#define BATCH_DOCUMENT_MEMORY (64 * 1024 * 1024)
+
+static void process_batch(std::vector<std::filesystem::path>& inputs,
+                          const Context& context,
+                          const Output& output,
+                          bool mapInput,
+                          const OPTARG_T output_path,
+                          const OPTARG_T output_dir) {
     
-    libpff_error_t *error = NULL;
-    int num_messages = 0;
-    int num_subfolders = 0;
-    if(libpff_folder_get_number_of_sub_messages(folder, &num_messages, &error) == 1){
-        if(libpff_folder_get_number_of_sub_folders(folder, &num_subfolders, &error) == 1){
-         
-            for (int i = 0; i < num_messages; ++i) {
-                libpff_item_t *sub_message = NULL;
-                if(libpff_folder_get_sub_message(folder, i, &sub_message, &error) == 1){
-                    Message message;
-                    size_t utf8_string_size = 0;
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_SUBJECT,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_SUBJECT,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            std::string subject = (const char *)buf.data();
-                            subject.erase(std::remove(subject.begin(), subject.end(), '\1'), subject.end());
-                            message.subject = subject;
-                        }
-                    }
-                    Account sender;
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_NAME,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_NAME,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            sender.name = (const char *)buf.data();
-                        }
-                    }
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_EMAIL_ADDRESS,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_SENDER_EMAIL_ADDRESS,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            sender.address = (const char *)buf.data();
-                        }
-                    }
-                    Account recipient;
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_NAME,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_NAME,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            recipient.name = (const char *)buf.data();
-                        }
-                    }
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_EMAIL_ADDRESS,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_RECEIVED_BY_EMAIL_ADDRESS,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            recipient.address = (const char *)buf.data();
-                        }
-                    }
-                    
-                    
-                    
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_BODY_PLAIN_TEXT,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_BODY_PLAIN_TEXT,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            message.text = (const char *)buf.data();
-                        }
-                    }
-                    message.sender = sender;
-                    message.recipient = recipient;
-                    
-                    /*
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_BODY_HTML,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_BODY_HTML,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            document.messages_html.push_back((const char *)buf.data());
-                        }
-                    }
-                    */
-                    /*
-                    if(libpff_message_get_entry_value_utf8_string_size(sub_message,
-                                                                       LIBPFF_ENTRY_TYPE_MESSAGE_BODY_COMPRESSED_RTF,
-                                                                       &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size + 1);
-                        if(libpff_message_get_entry_value_utf8_string(sub_message,
-                                                                      LIBPFF_ENTRY_TYPE_MESSAGE_BODY_COMPRESSED_RTF,
-                                                                       buf.data(), buf.size(), &error) == 1){
-                            document.messages_rtf.push_back((const char *)buf.data());
-                        }
-                    }
-                    */
-                    document.messages.push_back(message);
-                }
-            }
-            for (int i = 0; i < num_subfolders; ++i) {
-                libpff_item_t *sub_folder = NULL;
-                if(libpff_folder_get_sub_folder(folder, i, &sub_folder, &error) == 1){
-                    size_t utf8_string_size = 0;
-                    if(libpff_folder_get_utf8_name_size(sub_folder, &utf8_string_size, &error) == 1){
-                        std::vector<uint8_t>buf(utf8_string_size * 1);
-                        if(libpff_folder_get_utf8_name(sub_folder, buf.data(), buf.size(), &error) == 1){
-                            Folder _folder;
-                            _folder.name = (const char *)buf.data();
-                            process_folder(_folder, file, sub_folder);
-                            document.folders.push_back(_folder);
-                        }
-                    }
-                }
-            }
+    std::vector<std::filesystem::path> paths;
+    for (auto &input : inputs) {
+        std::error_code ec;
+        std::filesystem::path path = std::filesystem::absolute(input, ec).lexically_normal();
+        if(std::find(paths.begin(), paths.end(), path) == paths.end()) paths.push_back(path);
+    }
+    std::filesystem::path root = batch_root(paths);
+    
+    struct Item {
+        uintmax_t size;
+        std::filesystem::path path;
+        /* relative to the common root, for output and attachment names */
+        std::filesystem::path name;
+    };
+    std::vector<Item> queue;
+    for (auto &path : paths) {
+        std::error_code ec;
+        uintmax_t size = std::filesystem::file_size(path, ec);
+        std::filesystem::path name = path.lexically_relative(root);
+        /* on different windows drives there is no common root */
+        if(name.empty()) name = path.filename();
+        queue.push_back({ec ? 0 : size, path, name});
+    }
+    std::stable_sort(queue.begin(), queue.end(), [](const Item& a, const Item& b) {
+        return a.size > b.size;
+    });
+    
+    std::unique_ptr<Sink> merged;
+    if(!output_dir) {
+        FILE *f = output_path ? _fopen(output_path, _wb) : stdout;
+        if(!f) {
+            std::cerr << "Failed to open output file!" << std::endl;
+            return;
         }
+        merged.reset(new Sink(f, output_path != NULL));
     }
-}
-static void process_root_folder(Document& document,
-                           libpff_file_t *file,
-                           libpff_item_t *folder) {
     
-    libpff_error_t *error = NULL;
-    int num_subfolders = 0;
-    if(libpff_folder_get_number_of_sub_folders(folder, &num_subfolders, &error) == 1){
-        for (int i = 0; i < num_subfolders; ++i) {
-            libpff_item_t *sub_folder = NULL;
-            if(libpff_folder_get_sub_folder(folder, i, &sub_folder, &error) == 1){
-                size_t utf8_string_size = 0;
-                if(libpff_folder_get_utf8_name_size(sub_folder, &utf8_string_size, &error) == 1){
-                    std::vector<uint8_t>buf(utf8_string_size * 1);
-                    if(libpff_folder_get_utf8_name(sub_folder, buf.data(), buf.size(), &error) == 1){
-                        Folder folder;
-                        folder.name = (const char *)buf.data();
-                        process_folder(folder, file, sub_folder);
-                        document.folders.push_back(folder);
-                    }
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < queue.size(); i = next++) {
+            const std::filesystem::path& path = queue[i].path;
+            const std::filesystem::path& name = queue[i].name;
+            Context file_context = context;
+            file_context.jobs = 1;
+            file_context.filename = path.c_str();
+            file_context.memory = NULL;
+            file_context.memory_size = 0;
+            /* identifiers repeat between documents, so each gets its own attachment directory */
+            std::filesystem::path attachments_dir;
+            if((context.attachments) && (!context.store)) {
+                attachments_dir = *context.attachments / name;
+                std::error_code ec;
+                std::filesystem::create_directories(attachments_dir, ec);
+                file_context.attachments = &attachments_dir;
+            }
+            
+            Mapping mapping;
+            if((mapInput) && (mapping.map(file_context.filename))) {
+#if defined(LIBPFF_HAVE_BFIO)
+                file_context.memory = mapping.data();
+                file_context.memory_size = mapping.size();
+#endif
+            }
+            
+            Input input;
+            FileHandle file;
+            ItemHandle root_folder;
+            std::string type;
+            if(!open_document(file_context, input, file, root_folder, type)) {
+                std::cerr << "Skipped " << path_to_utf8(path) << std::endl;
+                continue;
+            }
+            if(merged) {
+                NdjsonWriter writer(*merged, file_context, path_to_utf8(path));
+                extract(writer, file_context, file, root_folder);
+            }else{
+                std::filesystem::path output_file = std::filesystem::path(output_dir) / name;
+                output_file += output.raw ? ".txt" : (output.ndjson ? ".ndjson" : ".json");
+                std::error_code ec;
+                std::filesystem::create_directories(output_file.parent_path(), ec);
+                FILE *f = _fopen(output_file.c_str(), _wb);
+                if(f) {
+                    Sink sink(f, true);
+                    write_document(sink, output, file_context, file, root_folder, type);
+                }else{
+                    std::cerr << "Failed to open output file!" << std::endl;
                 }
             }
         }
+    };
+    
+    size_t workers = std::min(queue.size(), (size_t)context.jobs);
+    if(context.max_memory) {
+        workers = std::min(workers, std::max((size_t)1, context.max_memory / BATCH_DOCUMENT_MEMORY));
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; ++i) {
+        threads.emplace_back(work);
+    }
+    for (auto &thread : threads) {
+        thread.join();
     }
 }
 
 int main(int argc, OPTARG_T argv[]) {
         
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
     const OPTARG_T input_path  = NULL;
     const OPTARG_T output_path = NULL;
+    const OPTARG_T stats_path  = NULL;
+    const OPTARG_T list_path   = NULL;
+    const OPTARG_T dir_path    = NULL;
+    const OPTARG_T output_dir  = NULL;
+    std::vector<std::filesystem::path> inputs;
     
 #if defined(_WIN32)
         std::wstring temp_input_path;
@@ -356,11 +4020,42 @@ int main(int argc, OPTARG_T argv[]) {
         std::string  temp_input_path;
 #endif
     
-    std::vector<unsigned char>msg_data(0);
+    arg_string stdin_path;
+    std::vector<uint8_t>stdin_data;
+    bool use_stdin = false;
 
     int ch;
     std::string text;
     bool rawText = false;
+    bool streamJson = false;
+    bool ndjson = false;
+    bool mapInput = false;
+    int jobs = 0;
+    Output output = {false, false, "", ""};
+    StringPool pool;
+    std::unique_ptr<Dedup> dedup;
+    const OPTARG_T dedup_path = NULL;
+    const OPTARG_T checkpoint_path = NULL;
+    bool resume = false;
+    const OPTARG_T manifest_path = NULL;
+    Manifest manifest;
+    std::vector<uint32_t> ids;
+    bool use_ids = false;
+    FolderFilter filter;
+    std::filesystem::path attachments_dir;
+    std::unique_ptr<AttachmentStore> store;
+    bool use_store = false;
+    std::vector<uint32_t> body = {
+        LIBPFF_ENTRY_TYPE_MESSAGE_BODY_PLAIN_TEXT,
+        LIBPFF_ENTRY_TYPE_MESSAGE_BODY_HTML,
+        LIBPFF_ENTRY_TYPE_MESSAGE_BODY_COMPRESSED_RTF
+    };
+    Context context = {0, 1, NULL, NULL, 0, 0, &pool, false, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, &body};
+    
+    std::list<arg_string> long_option_storage;
+    std::vector<OPTARG_T> args = expand_long_options(argc, argv, long_option_storage);
+    argc = (int)args.size() - 1;
+    argv = args.data();
     
     while ((ch = getopt(argc, argv, ARGS)) != -1){
         switch (ch){
@@ -371,24 +4066,105 @@ int main(int argc, OPTARG_T argv[]) {
                 output_path = optarg;
                 break;
             case '-':
-            {
-                _fseek(stdin, 0, SEEK_END);
-                size_t len = (size_t)_ftell(stdin);
-                _fseek(stdin, 0, SEEK_SET);
-                msg_data.resize(len);
-                fread(msg_data.data(), 1, msg_data.size(), stdin);
-                if(!create_temp_file_path(temp_input_path)){
-                    FILE *f = _fopen(temp_input_path.c_str(), _wb);
-                    if(f) {
-                        fwrite(msg_data.data(), 1, msg_data.size(), f);
-                        fclose(f);
-                    }
-                }
-            }
+                use_stdin = true;
                 break;
             case 'r':
                 rawText = true;
                 break;
+            case 's':
+                streamJson = true;
+                break;
+            case 'n':
+                ndjson = true;
+                break;
+            case 'm':
+                mapInput = true;
+                break;
+            case 'j':
+#if defined(_WIN32)
+                jobs = _wtoi(optarg);
+#else
+                jobs = atoi(optarg);
+#endif
+                if(jobs < 1) jobs = 1;
+                break;
+            case 'f':
+                context.fields = parse_fields(optarg);
+                break;
+            case 'S':
+                stats.enabled = true;
+                break;
+            case 'T':
+                stats.enabled = true;
+                stats_path = optarg;
+                break;
+            case 'F':
+                output.field_delimiter = parse_delimiter(optarg);
+                break;
+            case 'R':
+                output.record_delimiter = parse_delimiter(optarg);
+                break;
+            case 'I':
+                list_path = optarg;
+                break;
+            case 'D':
+                dir_path = optarg;
+                break;
+            case 'O':
+                output_dir = optarg;
+                break;
+            case 'M':
+                context.max_memory = parse_size(optarg);
+                break;
+            case 'C':
+                context.senders = true;
+                break;
+            case 'U':
+                if((optarg[0] == 'r') && (optarg[1] == 'e') && (optarg[2] == 'f') && (optarg[3] == 0)) {
+                    dedup.reset(new Dedup(Dedup::REF));
+                }else if((optarg[0] == 's') && (optarg[1] == 'k') && (optarg[2] == 'i') && (optarg[3] == 'p') && (optarg[4] == 0)) {
+                    dedup.reset(new Dedup(Dedup::SKIP));
+                }else{
+                    usage();
+                }
+                break;
+            case 'V':
+                dedup_path = optarg;
+                break;
+            case 'K':
+                checkpoint_path = optarg;
+                break;
+            case 'Z':
+                resume = true;
+                break;
+            case 'X':
+                manifest_path = optarg;
+                break;
+            case 'L':
+                parse_ids(optarg, ids);
+                use_ids = true;
+                break;
+            case 'P':
+                filter.add(path_to_utf8(std::filesystem::path(optarg)));
+                break;
+            case 'A':
+                attachments_dir = optarg;
+                break;
+            case 'B':
+                attachments_dir = optarg;
+                use_store = true;
+                break;
+            case 'E':
+#if defined(_WIN32)
+                context.embedded = _wtoi(optarg);
+#else
+                context.embedded = atoi(optarg);
+#endif
+                if(context.embedded < 0) context.embedded = 0;
+                break;
+            case 'Y':
+                parse_body_preference(optarg, body);
+                break;
             case 'h':
             default:
                 usage();
@@ -396,66 +4172,245 @@ int main(int argc, OPTARG_T argv[]) {
         }
     }
 
+    /* a bare - is not an option for every getopt; any other argument is an input */
+    for (int i = optind; i < argc; ++i) {
+        if((argv[i][0] == '-') && (argv[i][1] == 0)) {
+            use_stdin = true;
+        }else{
+            inputs.push_back(argv[i]);
+        }
+    }
+    
+    bool batch = (inputs.size() > 1) || (list_path) || (dir_path) || (output_dir);
+    
+    if((dedup_path) && (!dedup)) {
+        dedup.reset(new Dedup(Dedup::SKIP));
+    }
+    if(dedup) {
+        if(dedup_path) dedup->load(dedup_path);
+        context.dedup = dedup.get();
+    }
+    
+    /* one stream from several documents is always ndjson */
+    if((batch) && (!output_dir)) {
+        ndjson = true;
+        rawText = false;
+    }
+    
+    if(!context.fields) {
+        context.fields = DEFAULT_FIELDS;
+        if((ndjson) && (!rawText)) context.fields |= FIELD_RECIPIENTS;
+    }
+    
+    output.raw = rawText;
+    output.ndjson = ndjson;
+    
+    /* only line and record output can be cut at a message and appended to */
+    if((resume) && (!checkpoint_path)) {
+        usage();
+    }
+    if(checkpoint_path) {
+        if((batch) || (!output_path) || ((!rawText) && (!ndjson)) || (context.senders) || (manifest_path)) {
+            std::cerr << "--checkpoint needs -o with -n or -r, and no --senders or --manifest!" << std::endl;
+            exit(1);
+        }
+        context.checkpoint = checkpoint_path;
+    }
+    /* attachments are written as messages are read, before the writer finds the duplicates */
+    if((!attachments_dir.empty()) && (context.dedup) && (!use_store)) {
+        std::cerr << "--attachments cannot be used with --dedup, use --attachment-store!" << std::endl;
+        exit(1);
+    }
+    if(!attachments_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(attachments_dir, ec);
+        if(ec) {
+            std::cerr << "Failed to create attachment directory!" << std::endl;
+            exit(1);
+        }
+        context.attachments = &attachments_dir;
+        if(use_store) {
+            store.reset(new AttachmentStore(attachments_dir));
+            store->load();
+            context.store = store.get();
+        }
+    }
+    
+    /* a manifest would list the messages of skipped folders as removed */
+    if(!filter.empty()) {
+        if(manifest_path) {
+            std::cerr << "--folder cannot be used with --manifest!" << std::endl;
+            exit(1);
+        }
+        context.filter = &filter;
+    }
+    
+    /* identifiers are only unique within one document */
+    if(use_ids) {
+        if((batch) || (manifest_path)) {
+            std::cerr << "--ids takes a single document, without --manifest!" << std::endl;
+            exit(1);
+        }
+        context.ids = &ids;
+    }
+    if(manifest_path) {
+        if(batch) {
+            std::cerr << "--manifest takes a single document!" << std::endl;
+            exit(1);
+        }
+        manifest.load(manifest_path);
+        context.manifest = &manifest;
+    }
+    Resume resume_point;
+    if((resume) && (load_checkpoint(checkpoint_path, resume_point))) {
+        if((context.ids) && ((size_t)resume_point.message > ids.size())) {
+            std::cerr << "Invalid checkpoint!" << std::endl;
+            exit(1);
+        }
+        context.resume = &resume_point;
+    }else if((resume) && (std::filesystem::exists(std::filesystem::path(checkpoint_path)))) {
+        std::cerr << "Invalid checkpoint!" << std::endl;
+        exit(1);
+    }
+    
+    if(batch) {
+        if(input_path) inputs.insert(inputs.begin(), input_path);
+        if(list_path) read_input_list(inputs, list_path);
+        if(dir_path) read_input_dir(inputs, dir_path);
+        context.jobs = jobs ? jobs : std::max(1, (int)std::thread::hardware_concurrency());
+        process_batch(inputs, context, output, mapInput, output_path, output_dir);
+        if((dedup) && (dedup_path)) dedup->save(dedup_path);
+        if(store) store->save();
+        if(stats.enabled) {
+            report_stats(stats_path, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+        return 0;
+    }
+    
+    if((inputs.size()) && (!input_path)) {
+        input_path = inputs.front().c_str();
+    }
+    context.jobs = jobs ? jobs : 1;
+    
     const OPTARG_T filename = NULL;
     
     if(input_path) {
         filename = input_path;
     }else{
-        if(!msg_data.size()) {
+        if(!use_stdin) {
             usage();
         }
-        filename = temp_input_path.c_str();
+#if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        if(get_stdin_path(stdin_path)) {
+            filename = stdin_path.c_str();
+        }else{
+#if defined(LIBPFF_HAVE_BFIO)
+            read_stdin(stdin_data);
+            context.memory = stdin_data.data();
+            context.memory_size = stdin_data.size();
+#else
+            if((create_temp_file_path(temp_input_path)) || (!spool_stdin(temp_input_path))) {
+                std::cerr << "Failed to read stdin!" << std::endl;
+            }
+            filename = temp_input_path.c_str();
+#endif
+        }
+    }
+    context.filename = filename;
+    
+    Mapping mapping;
+    if((mapInput) && (!context.memory)) {
+        if(mapping.map(filename)) {
+#if defined(LIBPFF_HAVE_BFIO)
+            context.memory = mapping.data();
+            context.memory_size = mapping.size();
+#endif
+        }else{
+            std::cerr << "Failed to map input file!" << std::endl;
+        }
     }
     
-    libpff_file_t *file = NULL;
-    libpff_error_t *error = NULL;
+    /* the json tree holds the whole document, so a memory budget streams the same json */
+    if(context.max_memory) streamJson = true;
+    
+    /* everything but the json tree is written while the file is traversed */
+    bool streaming = (rawText) || (streamJson) || (ndjson);
+    
+    Input input;
+    FileHandle file;
+    ItemHandle root_folder;
     
     Document document;
+    bool extracted = false;
 
-    if (libpff_file_initialize(&file, &error) == 1) {            
-        if (_libpff_file_open(file, filename, LIBPFF_OPEN_READ, &error) == 1) {
-            uint8_t content_type = 0;
-            if(libpff_file_get_content_type(file, &content_type, &error) == 1){
-                switch (content_type) {
-                    case LIBPFF_FILE_CONTENT_TYPE_PST:
-                        document.type = "pst";
-                        break;
-                    case LIBPFF_FILE_CONTENT_TYPE_PAB:
-                        document.type = "pab";
-                        break;
-                    case LIBPFF_FILE_CONTENT_TYPE_OST:
-                        document.type = "ost";
-                        break;
+    if(open_document(context, input, file, root_folder, document.type)) {
+        if(streaming) {
+            FILE *f = NULL;
+            uint64_t offset = 0;
+            if(context.resume) {
+                /* anything written after the checkpoint is written again */
+                std::error_code ec;
+                std::filesystem::resize_file(output_path, context.resume->offset, ec);
+                if(!ec) {
+                    f = _fopen(output_path, _ab);
+                    offset = context.resume->offset;
                 }
-                libpff_item_t *root_folder = NULL;
-                if (libpff_file_get_root_folder(file, &root_folder, &error) == 1) {
-                    process_root_folder(document, file, root_folder);
-                    
-                    document_to_json(document, text, rawText);
-                }else{
-                    std::cerr << "Failed to get PFF root item!" << std::endl;
+            }else{
+                f = output_path ? _fopen(output_path, _wb) : stdout;
+            }
+            if(f) {
+                {
+                    Sink sink(f, output_path != NULL, offset);
+                    write_document(sink, output, context, file, root_folder, document.type);
+                    if((!output_path) && (!ndjson)) sink.write("\n");
+                }
+                extracted = true;
+                if(checkpoint_path) {
+                    std::error_code ec;
+                    std::filesystem::remove(checkpoint_path, ec);
                 }
             }else{
-                std::cerr << "Unknown file content type!" << std::endl;
+                std::cerr << "Failed to open output file!" << std::endl;
             }
         }else{
-            std::cerr << "Failed to load PFF file!" << std::endl;
+            DocumentWriter writer(document);
+            extract(writer, context, file, root_folder);
+            extracted = true;
+            
+            Timer timer(stats.serialization_ns);
+            document_to_json(document, text, context);
         }
-        libpff_file_free(&file, &error);
     }
+    root_folder.reset();
+    file.reset();
     
     if(temp_input_path.length()) {
         _unlink(temp_input_path.c_str());
     }
 
-    if(!output_path) {
-        std::cout << text << std::endl;
-    }else{
-        FILE *f = _fopen(output_path, _wb);
-        if(f) {
-            fwrite(text.c_str(), 1, text.length(), f);
-            fclose(f);
+    if(!streaming) {
+        Timer timer(stats.write_ns);
+        if(!output_path) {
+            std::cout << text << std::endl;
+        }else{
+            FILE *f = _fopen(output_path, _wb);
+            if(f) {
+                fwrite(text.c_str(), 1, text.length(), f);
+                fclose(f);
+            }
         }
+        stats.bytes_written += text.length();
+    }
+    
+    /* a document that could not be read would list every message as removed */
+    if((manifest_path) && (extracted)) manifest.save(manifest_path);
+    if((dedup) && (dedup_path)) dedup->save(dedup_path);
+    if(store) store->save();
+    
+    if(stats.enabled) {
+        report_stats(stats_path, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
     }
     
     return 0;
@@ -6,6 +6,19 @@
 #include <iostream>
 
 #include <string>
+#include <string_view>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
@@ -15,11 +28,24 @@
 
 #include "libpff.h"
 
+#if defined( LIBPFF_HAVE_BFIO )
+#include <libbfio.h>
+#endif
+
 #if defined(_WIN32)
 #include <windows.h>
 #include <tchar.h>
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <iconv.h>
+#include <cerrno>
 #endif
 
 #ifdef _WIN32
@@ -36,21 +62,25 @@
 #define _ftell ftell
 #define _rb "rb"
 #define _wb "wb"
+#define _ab "ab"
 #else
 #define _fopen _wfopen
 #define _fseek _fseeki64
 #define _ftell _ftelli64
 #define _rb L"rb"
 #define _wb L"wb"
+#define _ab L"ab"
 #endif
 
 #ifdef __GNUC__
 #define OPTARG_T char*
+#define OPTCHAR_T char
 #include <getopt.h>
 #else
 #ifndef _WINGETOPT_H_
 #define _WINGETOPT_H_
 #define OPTARG_T wchar_t*
+#define OPTCHAR_T wchar_t
 #define main wmain
 #define NULL    0
 #define EOF    (-1)